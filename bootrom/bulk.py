@@ -0,0 +1,85 @@
+#!python3
+#
+# Bulk memory transfer using the IP940 loader's br/bw monitor commands.
+#
+#   bulk.py <console> <data> read <addr> <len> <file>
+#   bulk.py <console> <data> write <addr> <file>
+#
+# Commands are sent on the console; the data moves on the loader's data
+# port (channel B at 921600 by default). Pass the console device for
+# both after selecting 'port 0'.
+#
+# Requires pyserial.
+#
+
+import sys
+import zlib
+
+import serial
+
+CONSOLE_BAUD = 115200
+DATA_BAUD = 921600
+CHUNK = 4096        # the port timeout applies per chunk, not per transfer
+
+
+def wait_for(port, prefix):
+    while True:
+        line = port.readline().decode("ascii", errors="replace").strip()
+        if line.startswith("!!"):
+            raise RuntimeError(line)
+        if line.startswith(prefix):
+            return line
+
+
+def read_exactly(port, length):
+    data = bytearray()
+    while len(data) < length:
+        chunk = port.read(min(CHUNK, length - len(data)))
+        if not chunk:
+            break
+        data += chunk
+    return bytes(data)
+
+
+def bulk_read(port, data_port, addr, length, path):
+    port.write(f"br {addr:x} {length:x}\r".encode())
+    wait_for(port, "++ br")
+    data = read_exactly(data_port, length)
+    trailer = read_exactly(data_port, 4)
+    if len(data) != length or len(trailer) != 4:
+        raise RuntimeError("short read")
+    if zlib.crc32(data) != int.from_bytes(trailer, "big"):
+        raise RuntimeError("CRC mismatch")
+    with open(path, "wb") as f:
+        f.write(data)
+
+
+def bulk_write(port, data_port, addr, path):
+    with open(path, "rb") as f:
+        data = f.read()
+    port.write(f"bw {addr:x} {len(data):x}\r".encode())
+    wait_for(port, "++ bw")
+    data_port.write(data)
+    data_port.write(zlib.crc32(data).to_bytes(4, "big"))
+    wait_for(port, "++ OK")
+
+
+def usage():
+    print(f"usage: {sys.argv[0]} <console> <data> read <addr> <len> <file>")
+    print(f"       {sys.argv[0]} <console> <data> write <addr> <file>")
+    sys.exit(1)
+
+
+# each sub-command takes a fixed number of arguments
+if (len(sys.argv) < 4) or ((sys.argv[3], len(sys.argv)) not in (("read", 7), ("write", 6))):
+    usage()
+
+with serial.Serial(sys.argv[1], CONSOLE_BAUD, rtscts=True, timeout=5) as port:
+    if sys.argv[2] == sys.argv[1]:
+        data_port = port
+    else:
+        data_port = serial.Serial(sys.argv[2], DATA_BAUD, rtscts=True, timeout=5)
+    if sys.argv[3] == "read":
+        bulk_read(port, data_port, int(sys.argv[4], 16), int(sys.argv[5], 16), sys.argv[6])
+    elif sys.argv[3] == "write":
+        bulk_write(port, data_port, int(sys.argv[4], 16), sys.argv[5])
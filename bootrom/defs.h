@@ -7,6 +7,8 @@
     .equ APP_END,           0x00200000  // end of ROM
     .equ DRAM_BASE,         0x01000000
     .equ DRAM_END,          0x01800000  // 8M board compatibility
+    .equ LOADER_TAIL,       0x001f8000  // rest of the C loader image, not for apps
+    .equ LOADER_BASE,       DRAM_END-0xc000 // lowest address of the resident C loader
 
 // Registers
     .equ TIMER_STOP,        0x0210003b  // any access stops CPLD timers
@@ -41,6 +43,35 @@
     .equ QUART_ICR,         QUART_BASE+(0x05<<2)+3
     .equ QUART_SPR,         QUART_BASE+(0x07<<2)+3
 
+// Loader services (services_t in ip940_lib.h). TRAP #0 returns the
+// table in a0 and the version in d0; the loader moves to the top of
+// DRAM, so the table has no fixed address. Entries follow the C
+// calling convention: arguments pushed as longs, result in d0,
+// d0-d1/a0-a1 trashed.
+    .equ SVC_MAGIC,         0x49505356
+    .equ SVC_VERSION,       4
+    .equ SVC_PUTC,          8
+    .equ SVC_PUTS,          12
+    .equ SVC_GETC,          16
+    .equ SVC_WAITC,         20
+    .equ SVC_UART_WRITE,    24
+    .equ SVC_UART_READY,    28
+    .equ SVC_UART_GETC,     32
+    .equ SVC_UART_READ,     36
+    .equ SVC_UART_FLUSH,    40
+    .equ SVC_UPTIME,        44
+    .equ SVC_TIMER_START,   48
+    .equ SVC_TIMER_STOP,    52
+    .equ SVC_CF_SIZE,       56
+    .equ SVC_CF_READ,       60
+    .equ SVC_CF_WRITE,      64
+    .equ SVC_CF_FLUSH,      68
+    .equ SVC_FLASH_ERASE,   72
+    .equ SVC_FLASH_PROGRAM, 76
+    .equ SVC_CRC32,         80
+    .equ SVC_ARENA_LIMIT,   84          // version 2
+    .equ SVC_PROBE_MAP,     88          // version 3
+
 // functions in utils.S
     .globl  uart_init
     .globl  getc
@@ -57,6 +88,18 @@
     .globl  fatal_param8
     .globl  stop
 
+// find the loader services table, leaves it in a5
+.macro msvc_init
+    trap    #0
+    move.l  %a0,%a5
+.endm
+
+// call a loader service, table in a5
+.macro msvc entry
+    move.l  %a5@(\entry),%a0
+    jsr     %a0@
+.endm
+
 // emit a string, trashes a0
 .macro mputs str
     lea     \str,%a0
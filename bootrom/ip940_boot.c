@@ -2,7 +2,7 @@
  * First-stage bootloader for IP940.
  *
  * TODO:
- *  - CF boot.
+ *  - CF boot from a FAT filesystem.
  */
 
 #include <stdbool.h>
@@ -11,94 +11,316 @@
 
 #define STR(_x) #_x
 #define XSTR(_x) STR(_x)
-static const char *banner =
+static const char banner[] =
     "\n**********************\n"
     "** IP940 ROM bootstrap\n"
     "**\n"
     "** version   : " XSTR(GITHASH) "\n";
 
 static bool flash_supported;
-static uint32_t dram_end;
 
 static inline bool contained(uint32_t _x, uint32_t _base, uint32_t _limit) {
     return (((_x) >= (_base)) && ((_x) < (_limit)));
 }
 
-static void
-autoboot_CF(void)
+// Boot sources, highest priority first. Each source is checked by a
+// step that runs once per timer tick until the source is ready or
+// absent, so slow checks (CF spin-up) overlap with the others and with
+// the cancel window. The highest-priority source that isn't absent is
+// booted once it is ready and its window has elapsed; a key cancels.
+enum {
+    SRC_WARM,
+    SRC_CF,
+    SRC_ROM,
+    SRC_MAX,
+};
+
+enum {
+    SRC_PENDING,
+    SRC_READY,
+    SRC_ABSENT,
+};
+
+static struct {
+    uint8_t     state;
+    uint32_t    window;         // ticks to allow the user to cancel
+} boot_sources[SRC_MAX] = {
+    { SRC_PENDING, TIMER_HZ },
+    { SRC_PENDING, 3 * TIMER_HZ },
+    { SRC_PENDING, 3 * TIMER_HZ },
+};
+static uint32_t boot_start;
+static image_t boot_warm_image;
+
+// Re-run the last program if this is a warm reset and its image
+// is still intact in DRAM.
+static uint32_t
+check_warm(void)
 {
-    print("** CF card   : ");
-    // check for CF card
-    print("not detected\n");
-    return;
-    // check for filesystem
-    // check for \IP940.SYS
-    // read header (what?) and validate (how?)
-    // load file
-    // run
+    const image_t *image = &boot_warm_image;
+
+    if (!warm_image(&boot_warm_image)) {
+        return SRC_ABSENT;
+    }
+    PRINT("++ re-run of ", HEX(image->load_base), "...", HEX(image->load_limit - 1),
+          " (pc=", HEX(image->entry), ")\n");
+    return SRC_READY;
 }
 
-static void
-autoboot_ROM(void)
+// Wait for the card to be identified and look for a boot ELF.
+static uint32_t
+check_CF(void)
+{
+    if (!cf_done()) {
+        return SRC_PENDING;
+    }
+    if (cf_sectors == 0) {
+        return SRC_ABSENT;
+    }
+
+    // boot ELF; it is only parsed when it is loaded
+    uint8_t sector[CF_SECTOR_SIZE];
+    if (!cf_read(CF_BOOT_LBA, sector, 1) ||
+        (sector[0] != 0x7f) ||
+        (sector[1] != 'E') ||
+        (sector[2] != 'L') ||
+        (sector[3] != 'F')) {
+        return SRC_ABSENT;
+    }
+    PRINT("++ CF boot ELF at LBA ", DEC(CF_BOOT_LBA), "\n");
+    return SRC_READY;
+}
+
+// An app is valid if the initial stack pointer is somewhere in DRAM,
+// and the initial PC is even and somewhere in the app space.
+static uint32_t
+check_ROM(void)
 {
     const uint32_t *app_vecs = (const uint32_t *)APP_BASE;
 
-    // An app is valid if the initial stack pointer is
-    // somewhere in DRAM, and the initial PC is even and
-    // somewhere in the app space.
     if (contained(app_vecs[0], DRAM_BASE, dram_end + 1) &&
-        contained(app_vecs[1], APP_BASE, APP_END) &&
+        contained(app_vecs[1], APP_BASE, LOADER_TAIL) &&
         ((app_vecs[1] & 1) == 0)) {
-        print("++ press any key to cancel ROM autoboot...\n");
-        if (waitc(3 * TIMER_HZ)) {
-            return;
+        return SRC_READY;
+    }
+    PRINT("!! no program in ROM (", HEX(app_vecs[0]), "/", HEX(app_vecs[1]), ").\n");
+    return SRC_ABSENT;
+}
+
+// Stream the CF boot ELF into DRAM and run it; returns only if it is
+// bad.
+static void
+boot_CF(void)
+{
+    image_t image;
+
+    PRINT("++ loading CF boot ELF\n");
+    cf_stream_start(CF_BOOT_LBA);
+    const bool loaded = elf_load(cf_stream_read, &image);
+    if (!cf_stream_ok()) {
+        PRINT("!! CF read failed\n");
+        return;
+    }
+    if (loaded) {
+        run_program(&image);
+    }
+}
+
+static void
+boot_ROM(void)
+{
+    const uint32_t *app_vecs = (const uint32_t *)APP_BASE;
+
+    PRINT("++ jumping to ROM application (sp=", HEX(app_vecs[0]),
+          " pc=", HEX(app_vecs[1]), ")\n");
+    uart_flush(UART_CONSOLE);
+    interrupt_disable();
+    timer_stop();
+    __asm__ volatile (
+        "   move.l %0,%%sp  \n"
+        "   jmp    (%1)     \n"
+        :
+        : "a" (app_vecs[0]), "a" (app_vecs[1])
+        : "memory"
+    );
+}
+
+static task_t boot_task;
+static bool boot_cancelled;
+static uint32_t boot_tick;
+static uint32_t boot_announced;
+
+// Run the boot source checks a step per tick and boot the best source
+// when it is ready and the bus map and DRAM test are complete; exits if
+// cancelled, if DRAM failed, or if nothing can be booted.
+static uint8_t
+boot_task_run(task_t *t)
+{
+    static const char names[SRC_MAX][8] = { "re-run", "CF", "ROM" };
+
+    TASK_BEGIN(t);
+    boot_start = timer_uptime();
+    boot_announced = SRC_MAX;
+    for (;;) {
+        if (boot_cancelled) {
+            TASK_EXIT(t);
+        }
+        if (post_done() && !post_passed()) {
+            PRINT("!! autoboot stopped\n");
+            TASK_EXIT(t);
+        }
+        boot_tick = timer_uptime();
+
+        for (uint32_t src = 0; src < SRC_MAX; src++) {
+            if (boot_sources[src].state == SRC_PENDING) {
+                switch (src) {
+                case SRC_WARM:
+                    boot_sources[src].state = check_warm();
+                    break;
+                case SRC_CF:
+                    boot_sources[src].state = check_CF();
+                    break;
+                case SRC_ROM:
+                    boot_sources[src].state = check_ROM();
+                    break;
+                }
+            }
+        }
+
+        // the best source decides; wait if it isn't ready yet
+        uint32_t best = 0;
+        while ((best < SRC_MAX) && (boot_sources[best].state == SRC_ABSENT)) {
+            best++;
+        }
+        if (best == SRC_MAX) {
+            TASK_EXIT(t);
         }
-        interrupt_disable();
-        print("++ jumping to ROM application (sp=%x pc=%x)\n", app_vecs[0], app_vecs[1]);
-        __asm__ volatile (
-            "   move.l %0,%%sp  \n"
-            "   jmp    (%1)     \n"
-            :
-            : "a" (app_vecs[0]), "a" (app_vecs[1])
-            : "memory"
-        );
-    }
-    print("!! no program in ROM (%x/%x).\n", app_vecs[0], app_vecs[1]);
+        if (boot_sources[best].state == SRC_READY) {
+            if (boot_announced != best) {
+                PRINT("++ press any key to cancel ", names[best], " autoboot...\n");
+                boot_announced = best;
+            }
+            if (((boot_tick - boot_start) >= boot_sources[best].window) &&
+                probe_done() && post_done()) {
+                switch (best) {
+                case SRC_WARM:
+                    run_program(&boot_warm_image);
+                    break;
+                case SRC_CF:
+                    boot_CF();
+                    break;
+                case SRC_ROM:
+                    boot_ROM();
+                    break;
+                }
+                // returned or failed, try the next source
+                boot_sources[best].state = SRC_ABSENT;
+                continue;
+            }
+        }
+        TASK_WAIT_UNTIL(t, timer_uptime() != boot_tick);
+    }
+    TASK_END(t);
 }
 
+static void
+boot_cancel(void)
+{
+    boot_cancelled = true;
+    PRINT("++ autoboot cancelled\n");
+}
 enum {
-    ST_OLD_BOOTBLOCK,
+    ST_BOOTBLOCK,
     ST_APP,
+    ST_LOADER,                  // loader tail, flashed with the bootblock
     ST_UPLOAD,
-    ST_BOOTBLOCK,
     ST_MAX,
 };
-static const struct srec_config_t {
+static struct srec_config_t {
     uint32_t    input_base;     // address must be >= this
     uint32_t    input_limit;    // address must be < this
     uint32_t    flash_offset;   // add to buffer offset to derive address to flash
     uint8_t     flags;
 #define FLG_REQUIRE_FLASH   (1<<0)
+#define FLG_STAGED          (1<<1)  // buffered in the staging area
     uint8_t     mode;
 } srec_configs[] = {
-    {0,             APP_BASE,       0,          FLG_REQUIRE_FLASH,  ST_OLD_BOOTBLOCK},
-    {APP_BASE,      APP_END,        APP_BASE,   FLG_REQUIRE_FLASH,  ST_APP},
-    {DRAM_BASE,     LOADER_BASE,    0,          0,                  ST_UPLOAD},
-    {LOADER_BASE,   LOADER_END,     0,          0,                  ST_BOOTBLOCK},
+    {0,             APP_BASE,       0,          FLG_STAGED,                     ST_BOOTBLOCK},
+    {APP_BASE,      LOADER_TAIL,    APP_BASE,   FLG_REQUIRE_FLASH | FLG_STAGED, ST_APP},
+    {LOADER_TAIL,   APP_END,        LOADER_TAIL, FLG_STAGED,                    ST_LOADER},
+    {DRAM_BASE,     0,              0,          0,                              ST_UPLOAD}, // to arena_limit()
     {0},
 };
-static const struct srec_config_t *srec_config;
 
-static uint32_t srec_bufaddr;
-static uint32_t srec_buf_start;
-static uint32_t srec_buf_end;
+// Portion of each region written by the current upload, as offsets
+// from the region's input_base; empty when start >= end.
+static struct srec_extent_t {
+    uint32_t    start;
+    uint32_t    end;
+} srec_extents[ST_MAX];
+
+// Staged regions are buffered in a copy of the flash layout at the top
+// of free DRAM. Sectors are initialised to blank the first time they
+// are written.
+#define STAGE_SECTORS   (APP_END / FLASH_SECTOR_SIZE)
+static uint32_t srec_stage;
+static uint32_t srec_stage_map[STAGE_SECTORS / 32];
+
 static uint32_t srec_entrypoint;
 static uint8_t srec_sum;
+static uint32_t srec_port;            // channel the upload arrived on
+
+static bool
+extent_present(uint32_t mode)
+{
+    return srec_extents[mode].start < srec_extents[mode].end;
+}
+
+static bool
+stage_sector_dirty(uint32_t sector)
+{
+    return (srec_stage_map[sector / 32] & (1U << (sector % 32))) != 0;
+}
+
+// Mark the stage sectors covering [flash_addr, flash_addr + len) as
+// dirty, blanking any that have not been written before.
+static void
+stage_touch(uint32_t flash_addr, uint32_t len)
+{
+    for (uint32_t sector = flash_addr / FLASH_SECTOR_SIZE;
+         sector <= (flash_addr + len - 1) / FLASH_SECTOR_SIZE;
+         sector++) {
+        if (!stage_sector_dirty(sector)) {
+            srec_stage_map[sector / 32] |= 1U << (sector % 32);
+            uint32_t *p = (uint32_t *)(srec_stage + sector * FLASH_SECTOR_SIZE);
+            for (uint32_t i = 0; i < (FLASH_SECTOR_SIZE / sizeof(*p)); i++) {
+                p[i] = 0xffffffff;
+            }
+        }
+    }
+}
+
+// Buffer address range used by a region, in whole sectors if staged.
+static void
+extent_buffer(uint32_t mode, uint32_t *base, uint32_t *limit)
+{
+    const struct srec_config_t *config = &srec_configs[mode];
+    const struct srec_extent_t *extent = &srec_extents[mode];
+
+    if (config->flags & FLG_STAGED) {
+        const uint32_t stage_base = srec_stage + config->flash_offset;
+        *base = stage_base + (extent->start & ~(FLASH_SECTOR_SIZE - 1));
+        *limit = stage_base + ((extent->end + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1));
+    } else {
+        *base = config->input_base + extent->start;
+        *limit = config->input_base + extent->end;
+    }
+}
 
 static uint8_t
 srecord_getx8(void)
 {
-    uint8_t v = getx8();
+    uint8_t v = getx8(srec_port);
     srec_sum += v;
     return v;
 }
@@ -118,7 +340,7 @@ srecord_check_sum(const char *type)
     // get checksum and validate
     (void)srecord_getx8();
     if (srec_sum != 0xff) {
-        print("\n!! S0 checksum invalid (%d)\n", srec_sum);
+        PRINT("\n!! S0 checksum invalid (", DEC(srec_sum), ")\n");
         return false;
     }
     return true;
@@ -132,7 +354,7 @@ srecord_s0(void)
     // get line length and validate
     uint8_t len = srecord_getx8();
     if ((len < 3) || (len > 200)) {
-        print("\n!! S0 length invalid (%d)\n", len);
+        PRINT("\n!! S0 length invalid (", DEC(len), ")\n");
         return false;
     }
 
@@ -152,7 +374,7 @@ srecord_s3(void)
     // get line length and validate
     uint8_t len = srecord_getx8();
     if ((len < 6) || (len > 200)) {
-        print("\n!! S3 length invalid (%d)\n", len);
+        PRINT("\n!! S3 length invalid (", DEC(len), ")\n");
         return false;
     }
     len -= 5;
@@ -160,47 +382,48 @@ srecord_s3(void)
     // get the line address
     uint32_t addr = srecord_getx32();
 
-    // first time aroumd use the address to determine what we are receiving
-    if (srec_config == NULL) {
-        for (int i = 0; i < ST_MAX; i++) {
-            if (contained(addr,
-                          srec_configs[i].input_base,
-                          srec_configs[i].input_limit) &&
-                contained(addr + len,
-                          srec_configs[i].input_base,
-                          srec_configs[i].input_limit)) {
-                srec_config = &srec_configs[i];
-                if (!flash_supported && (srec_config->flags & FLG_REQUIRE_FLASH)) {
-                    print("!! no flash ROM on this system\n");
-                    return false;
-                }
-                break;
-            }
+    // find the region the record falls in
+    const struct srec_config_t *config = NULL;
+    for (int i = 0; i < ST_MAX; i++) {
+        if (contained(addr,
+                      srec_configs[i].input_base,
+                      srec_configs[i].input_limit) &&
+            contained(addr + len - 1,
+                      srec_configs[i].input_base,
+                      srec_configs[i].input_limit)) {
+            config = &srec_configs[i];
+            break;
         }
     }
-    // validate the address / length fall within a legal region
-    if ((srec_config == NULL) ||
-        !contained(addr,
-                  srec_config->input_base,
-                  srec_config->input_limit) ||
-        !contained(addr + len,
-                  srec_config->input_base,
-                  srec_config->input_limit)) {
-        print("\n!! S3 address invalid (%x)\n", addr);
+    if (config == NULL) {
+        PRINT("\n!! S3 address invalid (", HEX(addr), ")\n");
+        return false;
+    }
+    if (!flash_supported && (config->flags & FLG_REQUIRE_FLASH)) {
+        PRINT("\n!! no flash ROM on this system\n");
         return false;
     }
 
-    // track the portion of the buffer that's been written
-    uint32_t buf_offset = addr - srec_config->input_base;
-    if (buf_offset < srec_buf_start) {
-        srec_buf_start = buf_offset;
+    // track the portion of the region that's been written
+    struct srec_extent_t *extent = &srec_extents[config->mode];
+    const uint32_t buf_offset = addr - config->input_base;
+    if (buf_offset < extent->start) {
+        extent->start = buf_offset;
     }
-    if ((buf_offset + len) > srec_buf_end) {
-        srec_buf_end = buf_offset + len;
+    if ((buf_offset + len) > extent->end) {
+        extent->end = buf_offset + len;
+    }
+
+    // find the buffer
+    uint8_t *buf_ptr;
+    if (config->flags & FLG_STAGED) {
+        stage_touch(config->flash_offset + buf_offset, len);
+        buf_ptr = (uint8_t *)(srec_stage + config->flash_offset + buf_offset);
+    } else {
+        buf_ptr = (uint8_t *)addr;
     }
 
     // copy S-record data to buffer
-    uint8_t *buf_ptr = (uint8_t *)(srec_bufaddr + buf_offset);
     while (len--) {
         *buf_ptr++ = srecord_getx8();
     }
@@ -217,18 +440,23 @@ srecord_s7(void)
     // get line length and validate
     uint8_t len = srecord_getx8();
     if (len != 5) {
-        print("!! S7 length invalid (%d)\n", len);
+        PRINT("!! S7 length invalid (", DEC(len), ")\n");
         return false;
     }
 
-    // get address and validate
+    // get address and validate; it must be in a region we received
     uint32_t addr = srecord_getx32();
-    if ((srec_config == NULL) ||
-        !contained(addr,
-                   srec_config->input_base,
-                   srec_config->input_limit) ||
-        (addr & 1)) {
-        print("!! S7 address invalid (%x)\n");
+    bool valid = false;
+    for (int i = 0; i < ST_MAX; i++) {
+        if (extent_present(i) &&
+            contained(addr,
+                      srec_configs[i].input_base,
+                      srec_configs[i].input_limit)) {
+            valid = true;
+        }
+    }
+    if (!valid || (addr & 1)) {
+        PRINT("!! S7 address invalid (", HEX(addr), ")\n");
         return false;
     }
 
@@ -237,174 +465,402 @@ srecord_s7(void)
     return srecord_check_sum("S7");
 }
 
-static bool
-srecord_receive(void)
+enum {
+    SREC_MORE,
+    SREC_FAIL,
+    SREC_DONE,
+};
+
+static bool srec_discard;             // no session in progress
+
+// Start a session; S-records are accepted on the console or the data
+// port, the monitor only listens to the console.
+static void
+srecord_begin(void)
 {
-    srec_config = NULL;
-    srec_bufaddr = DRAM_BASE;
-    srec_buf_start = 0;
-    srec_buf_end = 0;
+    for (int i = 0; i < ST_MAX; i++) {
+        srec_extents[i].start = ~0UL;
+        srec_extents[i].end = 0;
+    }
+    for (uint32_t i = 0; i < (STAGE_SECTORS / 32); i++) {
+        srec_stage_map[i] = 0;
+    }
+    srec_stage = arena_limit() - APP_END;
     srec_entrypoint = 0;
-    bool discard = true;
+    srec_discard = true;
 
-    // get data and entrypoint
-    print("++ ready for S-records\n");
-    for (;;) {
-        if (getc() != 'S') {
-            continue;
+    PRINT("++ ready for S-records or commands\n");
+    monitor_prompt();
+}
+
+// Once a session has started, its port is read until the S7 record,
+// so records aren't held up behind a STOP.
+static bool
+srecord_ready(void)
+{
+    if (!srec_discard) {
+        return true;
+    }
+    return uart_ready(UART_CONSOLE) || uart_ready(data_port);
+}
+
+// Consume a monitor key, or a whole record.
+static uint32_t
+srecord_poll(void)
+{
+    char c;
+    if (!srec_discard) {
+        c = uart_getc(srec_port);
+    } else if (uart_ready(UART_CONSOLE)) {
+        c = getc();
+        if (!monitor_key(c)) {
+            return SREC_MORE;
         }
-        char c = getc();
-        if (c == '0') {
-            if (!srecord_s0()) {
-                return false;
-            }
-            discard = false;
+        srec_port = UART_CONSOLE;
+    } else if (uart_ready(data_port)) {
+        c = uart_getc(data_port);
+        srec_port = data_port;
+    } else {
+        return SREC_MORE;
+    }
+    if (c != 'S') {
+        return SREC_MORE;
+    }
+    c = uart_getc(srec_port);
+    if (c == '0') {
+        if (!srecord_s0()) {
+            return SREC_FAIL;
         }
-        if (!discard) {
-            switch (c) {
-            case '3':
-                if (!srecord_s3()) {
-                    return false;
-                }
-                break;
-            case '7':
-                if (!srecord_s7()) {
-                    return false;
-                }
-                return true;
-            case '4':
-            case '5':
-            case '6':
-            default:
-                break;
+        srec_discard = false;
+    }
+    if (!srec_discard) {
+        switch (c) {
+        case '3':
+            if (!srecord_s3()) {
+                return SREC_FAIL;
             }
+            break;
+        case '7':
+            return srecord_s7() ? SREC_DONE : SREC_FAIL;
+        case '4':
+        case '5':
+        case '6':
+        default:
+            break;
         }
     }
+    return SREC_MORE;
 }
 
-static bool
-flash_program(void)
+static task_t flash_task;
+static uint32_t flash_mode;
+static uint32_t flash_addr;
+static uint32_t flash_start;
+static bool flash_ok;
+static flash_job_t flash_job;
+
+// Flash the dirty sectors of a staged region, last sector first so that
+// an interrupted update leaves the region's header unprogrammed. Each
+// sector is a job stepped once per pass, so the console and the TX pump
+// keep running.
+static uint8_t
+flash_task_run(task_t *t)
 {
-    switch (srec_config->mode) {
-    case ST_OLD_BOOTBLOCK:
-    case ST_BOOTBLOCK:
-        print("++ flash bootblock? ");
-        if (!askyn(5 * TIMER_HZ)) {
-            return true;
-        }
-        break;
-    case ST_APP:
-        break;
-    default:
-        return false;
-    }
+    uint32_t result;
 
-    // pad to sector boundaries
-    while (srec_buf_start % FLASH_SECTOR_SIZE) {
-        srec_buf_start--;
-        *(volatile uint8_t *)(srec_bufaddr + srec_buf_start) = 0xff;
+    TASK_BEGIN(t);
+    {
+        const struct srec_config_t *config = &srec_configs[flash_mode];
+        const struct srec_extent_t *extent = &srec_extents[flash_mode];
+        const uint32_t flash_end = config->flash_offset + extent->end;
+
+        flash_start = (config->flash_offset + extent->start) & ~(FLASH_SECTOR_SIZE - 1);
+        flash_addr = (flash_end - 1) & ~(FLASH_SECTOR_SIZE - 1);
+        PRINT("++ flashing ", HEX(flash_start), "...", HEX(flash_end - 1), " ");
     }
-    while (srec_buf_end % FLASH_SECTOR_SIZE) {
-        *(volatile uint8_t *)(srec_bufaddr + srec_buf_end) = 0xff;
-        srec_buf_end++;
+    flash_ok = false;
+    for (;;) {
+        if (stage_sector_dirty(flash_addr / FLASH_SECTOR_SIZE)) {
+            flash_job_start(&flash_job, (uint32_t *)flash_addr, (uint32_t *)(srec_stage + flash_addr));
+            while ((result = flash_job_step(&flash_job)) == FLASH_BUSY) {
+                TASK_YIELD(t);
+            }
+            if (result != FLASH_DONE) {
+                PRINT("\n!! FAIL (", HEX(flash_addr), ")\n");
+                TASK_EXIT(t);
+            }
+            PRINT(".");
+        }
+        if (flash_addr == flash_start) {
+            break;
+        }
+        flash_addr -= FLASH_SECTOR_SIZE;
     }
+    PRINT("\n++ OK\n");
+    flash_ok = true;
+    TASK_END(t);
+}
 
-    print("++ flashing %x...%x ",
-          srec_config->flash_offset + srec_buf_start,
-          srec_config->flash_offset + srec_buf_end - 1);
+static void
+flash_region(uint32_t mode)
+{
+    flash_mode = mode;
+    task_add(&flash_task, flash_task_run);
+}
 
-    // erase/flash each sector in turn
-    for (uint32_t buf_offset = srec_buf_start; buf_offset < srec_buf_end; buf_offset += FLASH_SECTOR_SIZE) {
-        const uint32_t flash_addr = srec_config->flash_offset + buf_offset;
-        const uint32_t buf_addr = srec_bufaddr + buf_offset;
+static uint32_t ask_start;
+static uint32_t ask_ticks;
+static bool ask_answer;
 
-        if (!flash_program_page((uint32_t *)flash_addr, (uint32_t *)buf_addr)) {
-            print("\n!! FAIL (%x)\n", flash_addr);
-            return false;
+// Ask a Y/N question without blocking; ticks == 0 waits forever.
+static void
+ask_begin(uint32_t ticks)
+{
+    while (uart_ready(UART_CONSOLE)) {
+        (void)getc();
+    }
+    PRINT("(Y/N) ");
+    ask_start = timer_uptime();
+    ask_ticks = ticks;
+}
+
+// True once answered or timed out, with the answer in ask_answer.
+static bool
+ask_done(void)
+{
+    while (uart_ready(UART_CONSOLE)) {
+        switch (getc()) {
+        case 'y':
+        case 'Y':
+            PRINT("Y\n");
+            ask_answer = true;
+            return true;
+        case 'n':
+        case 'N':
+            PRINT("N\n");
+            ask_answer = false;
+            return true;
         }
-        print(".");
     }
-    print("\n++ OK\n");
-    return true;
+    if (ask_ticks && ((timer_uptime() - ask_start) >= ask_ticks)) {
+        PRINT("timeout \n");
+        ask_answer = false;
+        return true;
+    }
+    return false;
 }
 
+// Sanity-check the session as a whole; the bootblock must contain the
+// reset vector, and a C loader must fit the bootblock and bring its
+// whole tail, as described by its header.
 static bool
-handle_upload(void) 
+upload_valid(void)
 {
-    switch (srec_config->mode) {
-    case ST_OLD_BOOTBLOCK:
-        // must flash reset stack/entrypoint
-        if (srec_buf_start != 0) {
-            print("!! bootblock start address invalid\n");
+    const uint32_t *stage_vecs = (const uint32_t *)srec_stage;
+
+    if (extent_present(ST_BOOTBLOCK) && (srec_extents[ST_BOOTBLOCK].start != 0)) {
+        PRINT("!! bootblock start address invalid\n");
+        return false;
+    }
+    if (extent_present(ST_BOOTBLOCK) && (stage_vecs[0xfc / 4] == LOADER_MAGIC)) {
+        const uint32_t boot_len = stage_vecs[LOADER_BOOT_LEN / 4];
+        const uint32_t tail_len = stage_vecs[LOADER_TAIL_LEN / 4];
+        if ((boot_len == 0) ||
+            (boot_len > APP_BASE) ||
+            (srec_extents[ST_BOOTBLOCK].end < boot_len)) {
+            PRINT("!! bootblock too large\n");
             return false;
         }
-        // we want to flash, not run
-        srec_entrypoint = 0;
-        break;
-    case ST_APP:
-        // we want to flash, not run
-        srec_entrypoint = 0;
-        break;
-    case ST_UPLOAD:
-        break;
-    case ST_BOOTBLOCK:
-        // must be able to obtain reset vector
-        if (srec_buf_start != 0) {
-            print("!! bootblock start address invalid\n");
+        if ((tail_len == 0) ||
+            (tail_len > LOADER_TAIL_SIZE) ||
+            !extent_present(ST_LOADER) ||
+            (srec_extents[ST_LOADER].start != 0) ||
+            (srec_extents[ST_LOADER].end < tail_len)) {
+            PRINT("!! loader tail missing or too large\n");
             return false;
         }
-        print("++ run uploaded bootblock? ");
-        if (askyn(0)) {
-            // synthesize entrypoint from reset vector
-            srec_entrypoint = ((uint32_t *)(srec_bufaddr))[1] + srec_bufaddr;
-        } else {
-            // we want to flash, not run
-            srec_entrypoint = 0;
-        }
-        break;
-    default:
+    } else if (extent_present(ST_LOADER)) {
+        PRINT("!! loader tail without a loader bootblock\n");
         return false;
     }
-
-    // if running, go now
-    if (srec_entrypoint) {
-        print("++ jumping to loaded program (pc=%x)\n", srec_entrypoint);
-        interrupt_disable();
-        __asm__ volatile (
-            "   jmp    (%0) \n"
-            :
-            : "a" (srec_entrypoint)
-            : "memory"
-        );
+    if (extent_present(ST_UPLOAD)) {
+        uint32_t upload_base, upload_limit;
+        extent_buffer(ST_UPLOAD, &upload_base, &upload_limit);
+        for (uint32_t mode = 0; mode < ST_MAX; mode++) {
+            uint32_t base, limit;
+            if ((srec_configs[mode].flags & FLG_STAGED) && extent_present(mode)) {
+                extent_buffer(mode, &base, &limit);
+                if ((base < upload_limit) && (upload_base < limit)) {
+                    PRINT("!! DRAM upload overlaps staging buffer\n");
+                    return false;
+                }
+            }
+        }
     }
+    return true;
+}
+
+// A C loader image can be run from the stage before flashing it; it
+// relocates itself like it does from ROM, fetching its tail from the
+// stage's copy of LOADER_TAIL.
+static bool
+upload_runnable(void)
+{
+    const uint32_t *stage_vecs = (const uint32_t *)srec_stage;
 
-    // otherwise, flash
-    return flash_program();
+    return extent_present(ST_BOOTBLOCK) && (stage_vecs[0xfc / 4] == LOADER_MAGIC);
 }
 
-__attribute__((noreturn))
-void main(void)
+static void
+run_bootblock(void)
 {
-    print(banner);
+    const uint32_t *stage_vecs = (const uint32_t *)srec_stage;
+
+    // synthesize entrypoint from reset vector
+    srec_entrypoint = stage_vecs[1] + srec_stage;
+    PRINT("++ jumping to loaded program (pc=", HEX(srec_entrypoint), ")\n");
+    uart_flush(UART_CONSOLE);
+    interrupt_disable();
+    timer_stop();
+    __asm__ volatile (
+        "   jmp    (%0) \n"
+        :
+        : "a" (srec_entrypoint)
+        : "memory"
+    );
+}
 
-    // detect 8/12M boards by checking for flashable ROM
-    flash_supported = flash_check_rom_id();
-    dram_end = flash_supported ? DRAM_END_MAX : DRAM_END;
-    print("** DRAM      : %dMiB\n", flash_supported ? 12 : 8);
-    print("** Flash ROM : %s\n", flash_supported ? "2048KiB" : "not detected");
+// Run the DRAM upload if it has the entrypoint.
+static void
+run_upload(void)
+{
+    if (extent_present(ST_UPLOAD) &&
+        contained(srec_entrypoint,
+                  srec_configs[ST_UPLOAD].input_base,
+                  srec_configs[ST_UPLOAD].input_limit)) {
+        image_t image;
+        extent_buffer(ST_UPLOAD, &image.load_base, &image.load_limit);
+        image.entry = srec_entrypoint;
+        image.text_base = image.load_base;
+        image.text_limit = image.load_limit;
+        image.bss_base = image.bss_limit = 0;
+        run_program(&image);
+    }
+}
 
-    // try to auto-boot from CF
-    autoboot_CF();
+static task_t console_task;
+static uint32_t console_result;
 
-    // try to auto-boot from ROM
-    autoboot_ROM();
+// The monitor and S-record sessions. A key cancels autoboot first; a
+// completed upload flashes the app, then the bootblock, then runs
+// anything uploaded to DRAM.
+static uint8_t
+console_task_run(task_t *t)
+{
+    TASK_BEGIN(t);
+    TASK_WAIT_UNTIL(t, !task_active(&boot_task) ||
+                    uart_ready(UART_CONSOLE) ||
+                    uart_ready(data_port));
+    if (task_active(&boot_task)) {
+        boot_cancel();
+        if (uart_ready(UART_CONSOLE)) {
+            (void)getc();
+        }
+    }
 
-    // upload / flash loop
+    // the S-record stage is in the range under test
+    TASK_WAIT_UNTIL(t, post_done());
     for (;;) {
+        srecord_begin();
+        for (;;) {
+            TASK_WAIT_UNTIL(t, srecord_ready());
+            console_result = srecord_poll();
+            if (console_result != SREC_MORE) {
+                break;
+            }
+            TASK_YIELD(t);
+        }
+        if ((console_result != SREC_DONE) || !upload_valid()) {
+            continue;
+        }
 
-        // wait for s-record upload
-        if (srecord_receive()) {
-            handle_upload();
+        // flash the application before the bootblock
+        if (extent_present(ST_APP)) {
+            flash_region(ST_APP);
+            TASK_WAIT_UNTIL(t, !task_active(&flash_task));
+            if (!flash_ok) {
+                continue;
+            }
+        }
+        if (upload_runnable()) {
+            PRINT("++ run uploaded bootblock? ");
+            ask_begin(0);
+            TASK_WAIT_UNTIL(t, ask_done());
+            if (ask_answer) {
+                run_bootblock();
+            }
+        }
+        if (extent_present(ST_BOOTBLOCK)) {
+            if (!flash_supported) {
+                PRINT("!! no flash ROM on this system\n");
+                continue;
+            }
+            PRINT("++ flash bootblock? ");
+            ask_begin(5 * TIMER_HZ);
+            TASK_WAIT_UNTIL(t, ask_done());
+            if (ask_answer) {
+                // bootblock and tail only work as a pair; flash the
+                // tail first and stop if it fails
+                if (extent_present(ST_LOADER)) {
+                    flash_region(ST_LOADER);
+                    TASK_WAIT_UNTIL(t, !task_active(&flash_task));
+                    if (!flash_ok) {
+                        continue;
+                    }
+                }
+                flash_region(ST_BOOTBLOCK);
+                TASK_WAIT_UNTIL(t, !task_active(&flash_task));
+                if (!flash_ok) {
+                    continue;
+                }
+            }
         }
+        run_upload();
+    }
+    TASK_END(t);
+}
+
+__attribute__((noreturn))
+void main(void)
+{
+    PRINT(banner);
+
+    // DRAM was sized by _reset; uploads may use everything below the
+    // loader's arena, once everything has been allocated from it
+    flash_supported = flash_check_rom_id();
+    cf_start();
+    srec_configs[ST_UPLOAD].input_limit = arena_limit();
+    PRINT("** DRAM      : ", DEC((dram_end - DRAM_BASE) >> 20), "MiB, ",
+          HEX(DRAM_BASE), "...", HEX(arena_limit() - 1), " free\n");
+    PRINT("** Flash ROM : ", flash_supported ? "2048KiB" : "not detected", "\n");
+    const uint32_t resets = warm_reset_count();
+    if (resets == 0) {
+        PRINT("** Reset     : cold\n");
+    } else {
+        PRINT("** Reset     : warm (", DEC(resets), ")\n");
+    }
+    while (uart_ready(UART_CONSOLE)) {
+        (void)getc();
     }
+
+    // map the bus and test DRAM while re-running the last program or
+    // booting from CF or ROM; a key cancels autoboot and starts the
+    // monitor / upload loop. DRAM was tested at power-on, so a warm
+    // reset runs the quick test, or none if the last program may be
+    // re-run from DRAM.
+    post_start((resets == 0) ? POST_FULL : warm_recorded() ? POST_SKIP : POST_QUICK);
+    probe_start();
+    task_add(&boot_task, boot_task_run);
+    task_add(&console_task, console_task_run);
+    task_run();
 }
@@ -0,0 +1,496 @@
+/*
+ * CompactFlash driver for IP940.
+ *
+ * The card is used in true-IDE / memory mode with LBA addressing and
+ * 16-bit PIO. Writes go through a small write-behind cache; dirty
+ * sectors are sorted and flushed as runs of consecutive LBAs with
+ * WRITE MULTIPLE, so that many small writes cost a few commands.
+ *
+ * Sector data is byte-swapped on the way through the 16-bit data
+ * register so that buffers hold sectors in the same byte order as a
+ * PC sees them.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "ip940_lib.h"
+
+// CF interface on baseboard
+#define CF_BASE             0x02100040
+#define CF_DATA             *((volatile uint16_t *)(CF_BASE+0x02))
+#define CF_REG(_reg)        *((volatile uint8_t *)(CF_BASE+((_reg)<<2)+3))
+#define CF_ERROR            CF_REG(0x01)
+#define CF_FEATURE          CF_REG(0x01)
+#define CF_SECTOR_COUNT     CF_REG(0x02)
+#define CF_LBA_0            CF_REG(0x03)
+#define CF_LBA_1            CF_REG(0x04)
+#define CF_LBA_2            CF_REG(0x05)
+#define CF_LBA_3            CF_REG(0x06)
+#define CF_STATUS           CF_REG(0x07)
+#define CF_COMMAND          CF_REG(0x07)
+
+#define STS_BSY             0x80
+#define STS_DRDY            0x40
+#define STS_DF              0x20
+#define STS_DRQ             0x08
+#define STS_ERR             0x01
+
+#define CMD_READ_SECTORS    0x20
+#define CMD_WRITE_SECTORS   0x30
+#define CMD_READ_MULTIPLE   0xc4
+#define CMD_WRITE_MULTIPLE  0xc5
+#define CMD_SET_MULTIPLE    0xc6
+#define CMD_IDENTIFY        0xec
+
+#define LBA_MODE            0xe0    // LBA, device 0
+#define CF_TIMEOUT          TIMER_HZ
+#define CF_READY_TIMEOUT    (5 * TIMER_HZ)  // power-on reset to ready
+#define CF_TIMEOUT_POLLS    1000000 // about a second of status reads
+#define CF_MULTIPLE_MAX     16      // sectors per DRQ block
+
+// write-behind cache
+#define CF_CACHE_SLOTS      8
+#define SLOT_FREE           0xffffffff
+
+uint32_t cf_sectors;                // capacity, 0 if no card
+char cf_model[41];
+static uint32_t cf_multiple;        // sectors per DRQ block, 0 for single
+
+static struct cf_slot {
+    uint32_t    lba;                // SLOT_FREE if unused
+    uint16_t    data[CF_SECTOR_SIZE / 2];
+} *cf_cache;                        // CF_CACHE_SLOTS, from the arena
+static uint32_t cf_dirty;           // number of slots in use
+
+static void
+copy_sector(void *dst, const void *src)
+{
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+
+    for (uint32_t i = 0; i < CF_SECTOR_SIZE; i++) {
+        *d++ = *s++;
+    }
+}
+
+static inline uint16_t
+swap16(uint16_t w)
+{
+    return (w << 8) | (w >> 8);
+}
+
+// Wait for the card to be idle with all of the bits in mask set. The
+// timeout is counted in ticks when they can arrive, or in polls when
+// the timer is stopped or interrupts are masked (a running program,
+// or cf_dump() from the exception handler); the timer is left alone
+// in that case.
+static bool
+cf_wait(uint8_t mask)
+{
+    const bool ticking = timer_ticking();
+    uint32_t polls = CF_TIMEOUT_POLLS;
+
+    if (ticking) {
+        timer_start(CF_TIMEOUT);
+    }
+    for (;;) {
+        const uint8_t status = CF_STATUS;
+        if ((status & STS_BSY) == 0) {
+            if (status & (STS_ERR | STS_DF)) {
+                return false;
+            }
+            if ((status & mask) == mask) {
+                return true;
+            }
+        }
+        if (ticking ? (timer_count == 0) : (--polls == 0)) {
+            return false;
+        }
+    }
+}
+
+static bool
+cf_command(uint8_t command, uint32_t lba, uint32_t count)
+{
+    if (!cf_wait(STS_DRDY)) {
+        return false;
+    }
+    CF_SECTOR_COUNT = count;        // 0 means 256
+    CF_LBA_0 = lba;
+    CF_LBA_1 = lba >> 8;
+    CF_LBA_2 = lba >> 16;
+    CF_LBA_3 = LBA_MODE | ((lba >> 24) & 0x0f);
+    CF_COMMAND = command;
+    return true;
+}
+
+static void
+cf_read_data(uint16_t *p)
+{
+    for (uint32_t i = 0; i < (CF_SECTOR_SIZE / 2); i++) {
+        *p++ = swap16(CF_DATA);
+    }
+}
+
+static void
+cf_write_data(const uint16_t *p)
+{
+    for (uint32_t i = 0; i < (CF_SECTOR_SIZE / 2); i++) {
+        CF_DATA = swap16(*p++);
+    }
+}
+
+// Non-blocking checks for startup; a card may take a while after
+// power-on to finish its reset and become ready for commands.
+static bool
+cf_present(void)
+{
+    // floating bus, no card
+    return CF_STATUS != 0xff;
+}
+
+static bool
+cf_ready(void)
+{
+    return (CF_STATUS & (STS_BSY | STS_DRDY)) == STS_DRDY;
+}
+
+// Probe for a card and identify it; returns true if one is present.
+static bool
+cf_init(void)
+{
+    uint16_t *id = cf_cache[0].data;
+
+    cf_sectors = 0;
+    cf_dirty = 0;
+    for (uint32_t i = 0; i < CF_CACHE_SLOTS; i++) {
+        cf_cache[i].lba = SLOT_FREE;
+    }
+
+    // floating bus, no card
+    if (CF_STATUS == 0xff) {
+        return false;
+    }
+    CF_LBA_3 = LBA_MODE;
+    if (!cf_command(CMD_IDENTIFY, 0, 0) ||
+        !cf_wait(STS_DRQ)) {
+        return false;
+    }
+    // IDENTIFY data is words, not bytes; don't swap
+    for (uint32_t i = 0; i < (CF_SECTOR_SIZE / 2); i++) {
+        id[i] = CF_DATA;
+    }
+    for (uint32_t i = 0; i < 20; i++) {
+        cf_model[i * 2] = id[27 + i] >> 8;
+        cf_model[i * 2 + 1] = id[27 + i];
+    }
+    for (int i = 39; (i >= 0) && (cf_model[i] == ' '); i--) {
+        cf_model[i] = '\0';
+    }
+    cf_sectors = id[60] | ((uint32_t)id[61] << 16);
+
+    // use the largest multiple-sector block the card supports
+    cf_multiple = id[47] & 0xff;
+    if (cf_multiple > CF_MULTIPLE_MAX) {
+        cf_multiple = CF_MULTIPLE_MAX;
+    }
+    if (cf_multiple > 1) {
+        if (!cf_command(CMD_SET_MULTIPLE, 0, cf_multiple) ||
+            !cf_wait(STS_DRDY)) {
+            cf_multiple = 0;
+        }
+    } else {
+        cf_multiple = 0;
+    }
+    return cf_sectors != 0;
+}
+
+// Read sectors straight from the card, without looking in the cache.
+static bool
+cf_read_sectors(uint32_t lba, uint16_t *buf, uint32_t count)
+{
+    const uint32_t block = cf_multiple ? cf_multiple : 1;
+
+    while (count > 0) {
+        const uint32_t n = (count > 256) ? 256 : count;
+        if (!cf_command(cf_multiple ? CMD_READ_MULTIPLE : CMD_READ_SECTORS, lba, n)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            if (((i % block) == 0) && !cf_wait(STS_DRQ)) {
+                return false;
+            }
+            cf_read_data(buf);
+            buf += CF_SECTOR_SIZE / 2;
+        }
+        lba += n;
+        count -= n;
+    }
+    return true;
+}
+
+// Write a run of sectors whose data is supplied by sector().
+static bool
+cf_write_run(uint32_t lba,
+             uint32_t count,
+             const uint16_t *(*sector)(uint32_t n, const void *arg),
+             const void *arg)
+{
+    const uint32_t block = cf_multiple ? cf_multiple : 1;
+
+    if (!cf_command(cf_multiple ? CMD_WRITE_MULTIPLE : CMD_WRITE_SECTORS, lba, count)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (((i % block) == 0) && !cf_wait(STS_DRQ)) {
+            return false;
+        }
+        cf_write_data(sector(i, arg));
+    }
+    return cf_wait(STS_DRDY);
+}
+
+static const uint16_t *
+cache_sector(uint32_t n, const void *arg)
+{
+    const uint8_t *slots = arg;
+    return cf_cache[slots[n]].data;
+}
+
+// Write all dirty sectors, sorted by LBA and coalesced into runs.
+bool
+cf_flush(void)
+{
+    uint8_t order[CF_CACHE_SLOTS];
+    uint32_t n = 0;
+    bool ok = true;
+
+    if (cf_dirty == 0) {
+        return true;
+    }
+    for (uint32_t i = 0; i < CF_CACHE_SLOTS; i++) {
+        if (cf_cache[i].lba != SLOT_FREE) {
+            uint32_t j = n++;
+            while ((j > 0) && (cf_cache[order[j - 1]].lba > cf_cache[i].lba)) {
+                order[j] = order[j - 1];
+                j--;
+            }
+            order[j] = i;
+        }
+    }
+    for (uint32_t start = 0; start < n;) {
+        uint32_t end = start + 1;
+        while ((end < n) && (cf_cache[order[end]].lba == (cf_cache[order[end - 1]].lba + 1))) {
+            end++;
+        }
+        if (!cf_write_run(cf_cache[order[start]].lba, end - start, cache_sector, &order[start])) {
+            ok = false;
+        }
+        start = end;
+    }
+    for (uint32_t i = 0; i < CF_CACHE_SLOTS; i++) {
+        cf_cache[i].lba = SLOT_FREE;
+    }
+    cf_dirty = 0;
+    return ok;
+}
+
+bool
+cf_read(uint32_t lba, void *buf, uint32_t count)
+{
+    if ((cf_sectors == 0) || ((lba + count) > cf_sectors)) {
+        return false;
+    }
+    if (!cf_read_sectors(lba, buf, count)) {
+        return false;
+    }
+
+    // newer data may still be in the cache
+    if (cf_dirty) {
+        for (uint32_t i = 0; i < CF_CACHE_SLOTS; i++) {
+            const uint32_t slot_lba = cf_cache[i].lba;
+            if ((slot_lba != SLOT_FREE) && (slot_lba >= lba) && (slot_lba < (lba + count))) {
+                copy_sector((uint8_t *)buf + (slot_lba - lba) * CF_SECTOR_SIZE,
+                            cf_cache[i].data);
+            }
+        }
+    }
+    return true;
+}
+
+// Queue sectors for writing; the cache is flushed when it fills.
+bool
+cf_write(uint32_t lba, const void *buf, uint32_t count)
+{
+    const uint8_t *src = buf;
+
+    if ((cf_sectors == 0) || ((lba + count) > cf_sectors)) {
+        return false;
+    }
+    for (; count > 0; count--, lba++, src += CF_SECTOR_SIZE) {
+        uint32_t slot = CF_CACHE_SLOTS;
+        for (uint32_t i = 0; i < CF_CACHE_SLOTS; i++) {
+            if (cf_cache[i].lba == lba) {
+                slot = i;
+                break;
+            }
+            if ((slot == CF_CACHE_SLOTS) && (cf_cache[i].lba == SLOT_FREE)) {
+                slot = i;
+            }
+        }
+        if (slot == CF_CACHE_SLOTS) {
+            if (!cf_flush()) {
+                return false;
+            }
+            slot = 0;
+        }
+        if (cf_cache[slot].lba != lba) {
+            cf_cache[slot].lba = lba;
+            cf_dirty++;
+        }
+        copy_sector(cf_cache[slot].data, src);
+    }
+    return true;
+}
+
+// Sequential byte source over consecutive sectors, for elf_load(),
+// which has no way to report a read error; check cf_stream_ok() when
+// it returns.
+static uint32_t cf_stream_lba;
+static uint32_t cf_stream_pos;
+static bool cf_stream_failed;
+static uint8_t cf_stream_buf[CF_SECTOR_SIZE];
+
+void
+cf_stream_start(uint32_t lba)
+{
+    cf_stream_lba = lba;
+    cf_stream_pos = CF_SECTOR_SIZE;
+    cf_stream_failed = false;
+}
+
+void
+cf_stream_read(void *buf, uint32_t len)
+{
+    uint8_t *p = buf;
+
+    while (len--) {
+        if (cf_stream_pos == CF_SECTOR_SIZE) {
+            if (!cf_stream_failed && !cf_read(cf_stream_lba++, cf_stream_buf, 1)) {
+                cf_stream_failed = true;
+            }
+            cf_stream_pos = 0;
+        }
+        *p++ = cf_stream_failed ? 0 : cf_stream_buf[cf_stream_pos];
+        cf_stream_pos++;
+    }
+}
+
+bool
+cf_stream_ok(void)
+{
+    return !cf_stream_failed;
+}
+
+// identification /////////////////////////////////////////////////////////////
+
+static task_t cf_task;
+static uint32_t cf_start_tick;
+
+// Wait for the card to finish its reset and identify it.
+static uint8_t
+cf_task_run(task_t *t)
+{
+    TASK_BEGIN(t);
+    if (!cf_present()) {
+        PRINT("** CF card   : not detected\n");
+        TASK_EXIT(t);
+    }
+    cf_start_tick = timer_uptime();
+    TASK_WAIT_UNTIL(t, cf_ready() || ((timer_uptime() - cf_start_tick) >= CF_READY_TIMEOUT));
+    if (!cf_ready()) {
+        PRINT("** CF card   : not ready\n");
+        TASK_EXIT(t);
+    }
+    if (!cf_init()) {
+        PRINT("** CF card   : not responding\n");
+        TASK_EXIT(t);
+    }
+    PRINT("** CF card   : ", cf_model, ", ", DEC(cf_sectors / 2048), "MiB\n");
+    TASK_END(t);
+}
+
+// Identify the card in the background, independent of autoboot, so
+// that the CF commands, services and crash dumps can use it. The cache
+// is allocated now, before anything is placed below the arena.
+void
+cf_start(void)
+{
+    cf_cache = arena_alloc(CF_CACHE_SLOTS * sizeof(struct cf_slot));
+    task_add(&cf_task, cf_task_run);
+}
+
+bool
+cf_done(void)
+{
+    return !task_active(&cf_task);
+}
+
+// crash dump /////////////////////////////////////////////////////////////////
+
+// Sector 0 of the dump holds the header, registers and exception
+// frame, the remainder a copy of the stack above the frame.
+typedef struct {
+    uint32_t    magic[2];           // 'IP94' 'DUMP'
+    uint32_t    vector;
+    uint32_t    pc;
+    uint32_t    sr;
+    uint32_t    sp;
+    regs_t      regs;
+    uint32_t    frame_size;
+    uint8_t     frame[92];          // largest 68040 frame
+} cf_dump_header_t;
+
+static const uint16_t *
+dump_sector(uint32_t n, const void *arg)
+{
+    static uint16_t sector[CF_SECTOR_SIZE / 2];
+    const regs_t *regs = arg;
+    const frame_t *frame = (const frame_t *)(regs + 1);
+    const uint32_t sp = (uint32_t)frame + frame_size(frame);
+
+    for (uint32_t i = 0; i < (CF_SECTOR_SIZE / 2); i++) {
+        sector[i] = 0;
+    }
+    if (n == 0) {
+        cf_dump_header_t *hdr = (cf_dump_header_t *)sector;
+        hdr->magic[0] = 0x49503934;
+        hdr->magic[1] = 0x44554d50;
+        hdr->vector = frame->vector / 4;
+        hdr->pc = frame->pc;
+        hdr->sr = frame->sr;
+        hdr->sp = sp;
+        hdr->regs = *regs;
+        hdr->frame_size = frame_size(frame);
+        safe_copy(hdr->frame, frame, hdr->frame_size);
+    } else {
+        // the stack may run off the end of memory
+        safe_copy(sector, (const void *)(sp + (n - 1) * CF_SECTOR_SIZE), CF_SECTOR_SIZE);
+    }
+    return sector;
+}
+
+// Write the state at an exception to the reserved dump area, bypassing
+// the cache. Best-effort; the fault may have interrupted a CF command.
+void
+cf_dump(const regs_t *regs)
+{
+    if (cf_sectors == 0) {
+        return;
+    }
+    if (cf_write_run(CF_DUMP_LBA, CF_DUMP_SECTORS, dump_sector, regs)) {
+        PRINT("++ crash dump written to CF LBA ", DEC(CF_DUMP_LBA), "\n");
+    } else {
+        PRINT("!! crash dump to CF failed\n");
+    }
+}
@@ -0,0 +1,197 @@
+/*
+ * Streaming ELF32 loader for IP940.
+ *
+ * The file is consumed strictly in order from a byte source, so it can
+ * come straight from the UART. PT_LOAD segments are copied directly
+ * to their physical address and the BSS tail is zeroed locally.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "ip940_lib.h"
+
+#define EI_NIDENT       16
+#define ELFCLASS32      1
+#define ELFDATA2MSB     2
+#define ET_EXEC         2
+#define EM_68K          4
+#define PT_LOAD         1
+#define PF_X            1
+
+typedef struct {
+    uint8_t     e_ident[EI_NIDENT];
+    uint16_t    e_type;
+    uint16_t    e_machine;
+    uint32_t    e_version;
+    uint32_t    e_entry;
+    uint32_t    e_phoff;
+    uint32_t    e_shoff;
+    uint32_t    e_flags;
+    uint16_t    e_ehsize;
+    uint16_t    e_phentsize;
+    uint16_t    e_phnum;
+    uint16_t    e_shentsize;
+    uint16_t    e_shnum;
+    uint16_t    e_shstrndx;
+} Elf32_Ehdr;
+
+typedef struct {
+    uint32_t    p_type;
+    uint32_t    p_offset;
+    uint32_t    p_vaddr;
+    uint32_t    p_paddr;
+    uint32_t    p_filesz;
+    uint32_t    p_memsz;
+    uint32_t    p_flags;
+    uint32_t    p_align;
+} Elf32_Phdr;
+
+// The ELF header and program headers are kept, since the first segment
+// commonly starts at file offset 0 and includes them.
+#define ELF_HEAD_MAX    512
+#define ELF_PHNUM_MAX   ((ELF_HEAD_MAX - sizeof(Elf32_Ehdr)) / sizeof(Elf32_Phdr))
+
+static union {
+    uint8_t     bytes[ELF_HEAD_MAX];
+    Elf32_Ehdr  ehdr;
+} elf_head;
+static uint32_t elf_head_len;
+static uint32_t elf_pos;
+static void (*elf_read)(void *buf, uint32_t len);
+
+// Copy len bytes at file offset to dst; offsets already consumed are
+// only available from the saved headers.
+static bool
+elf_copy(uint8_t *dst, uint32_t offset, uint32_t len)
+{
+    while ((len > 0) && (offset < elf_pos)) {
+        if (offset >= elf_head_len) {
+            return false;
+        }
+        *dst++ = elf_head.bytes[offset++];
+        len--;
+    }
+    while (elf_pos < offset) {
+        uint8_t discard;
+        elf_read(&discard, 1);
+        elf_pos++;
+    }
+    elf_read(dst, len);
+    elf_pos += len;
+    return true;
+}
+
+bool
+elf_load(void (*read)(void *buf, uint32_t len), image_t *image)
+{
+    const Elf32_Ehdr *ehdr = &elf_head.ehdr;
+
+    elf_read = read;
+    elf_pos = 0;
+    elf_head_len = 0;
+
+    // ELF header
+    if (!elf_copy(elf_head.bytes, 0, sizeof(*ehdr))) {
+        return false;
+    }
+    elf_head_len = sizeof(*ehdr);
+    if ((ehdr->e_ident[0] != 0x7f) ||
+        (ehdr->e_ident[1] != 'E') ||
+        (ehdr->e_ident[2] != 'L') ||
+        (ehdr->e_ident[3] != 'F') ||
+        (ehdr->e_ident[4] != ELFCLASS32) ||
+        (ehdr->e_ident[5] != ELFDATA2MSB) ||
+        (ehdr->e_type != ET_EXEC) ||
+        (ehdr->e_machine != EM_68K)) {
+        PRINT("!! not an m68k ELF executable\n");
+        return false;
+    }
+
+    // program headers
+    const uint32_t ph_size = ehdr->e_phnum * sizeof(Elf32_Phdr);
+    if ((ehdr->e_phentsize != sizeof(Elf32_Phdr)) ||
+        (ehdr->e_phnum > ELF_PHNUM_MAX) ||
+        (ehdr->e_phoff < sizeof(*ehdr)) ||
+        ((ehdr->e_phoff + ph_size) > ELF_HEAD_MAX)) {
+        PRINT("!! unsupported program headers\n");
+        return false;
+    }
+    elf_copy(elf_head.bytes + sizeof(*ehdr), sizeof(*ehdr), ehdr->e_phoff + ph_size - sizeof(*ehdr));
+    elf_head_len = ehdr->e_phoff + ph_size;
+
+    // sort loadable segments by file offset so they stream in order
+    const Elf32_Phdr *phdrs = (const Elf32_Phdr *)(elf_head.bytes + ehdr->e_phoff);
+    const Elf32_Phdr *load[ELF_PHNUM_MAX];
+    uint32_t nload = 0;
+    for (uint32_t i = 0; i < ehdr->e_phnum; i++) {
+        const Elf32_Phdr *ph = &phdrs[i];
+        if ((ph->p_type != PT_LOAD) || (ph->p_memsz == 0)) {
+            continue;
+        }
+        // compare sizes rather than end addresses, which can wrap
+        if ((ph->p_filesz > ph->p_memsz) ||
+            (ph->p_paddr < DRAM_BASE) ||
+            (ph->p_paddr >= arena_limit()) ||
+            (ph->p_memsz > (arena_limit() - ph->p_paddr))) {
+            PRINT("!! segment ", HEX(ph->p_paddr), "...", HEX(ph->p_paddr + ph->p_memsz - 1),
+                  " outside DRAM upload area\n");
+            return false;
+        }
+        uint32_t j = nload++;
+        while ((j > 0) && (load[j - 1]->p_offset > ph->p_offset)) {
+            load[j] = load[j - 1];
+            j--;
+        }
+        load[j] = ph;
+    }
+
+    // copy segments and zero BSS
+    image->entry = ehdr->e_entry;
+    image->text_base = ~0UL;
+    image->text_limit = 0;
+    image->load_base = ~0UL;
+    image->load_limit = 0;
+    image->bss_base = 0;
+    image->bss_limit = 0;
+    for (uint32_t i = 0; i < nload; i++) {
+        const Elf32_Phdr *ph = load[i];
+        uint8_t *dst = (uint8_t *)ph->p_paddr;
+
+        PRINT("++ load ", HEX(ph->p_paddr), "...", HEX(ph->p_paddr + ph->p_memsz - 1));
+        if (!elf_copy(dst, ph->p_offset, ph->p_filesz)) {
+            PRINT("\n!! segment overlaps headers\n");
+            return false;
+        }
+        for (uint32_t n = ph->p_filesz; n < ph->p_memsz; n++) {
+            dst[n] = 0;
+        }
+        PRINT(" (", DEC(ph->p_memsz - ph->p_filesz), " bytes zeroed)\n");
+
+        // the BSS of the highest segment is excluded from the loaded range
+        if (ph->p_paddr < image->load_base) {
+            image->load_base = ph->p_paddr;
+        }
+        if ((ph->p_paddr + ph->p_memsz) > image->bss_limit) {
+            image->load_limit = ph->p_paddr + ph->p_filesz;
+            image->bss_base = ph->p_paddr + ph->p_filesz;
+            image->bss_limit = ph->p_paddr + ph->p_memsz;
+        }
+
+        if (ph->p_flags & PF_X) {
+            if (ph->p_paddr < image->text_base) {
+                image->text_base = ph->p_paddr;
+            }
+            if ((ph->p_paddr + ph->p_memsz) > image->text_limit) {
+                image->text_limit = ph->p_paddr + ph->p_memsz;
+            }
+        }
+    }
+    if ((image->text_base >= image->text_limit) ||
+        (image->entry < image->text_base) ||
+        (image->entry >= image->text_limit) ||
+        (image->entry & 1)) {
+        PRINT("!! entrypoint invalid (", HEX(image->entry), ")\n");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,458 @@
+/*
+ * GDB remote serial protocol stub for IP940.
+ *
+ * Entered from _sleh for any exception, with the registers saved by
+ * _fleh. Breakpoints are TRAP #15 (the GDB m68k breakpoint), single-step
+ * uses trace mode. Memory is accessed with safe_copy() so that stray
+ * reads from the debugger don't fault the stub.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "ip940_lib.h"
+
+#define GDB_BUF_SIZE        1024
+#define GDB_NUM_REGS        18      // d0-d7, a0-a7, sr, pc
+#define GDB_MAX_BREAKPOINTS 16
+#define BREAKPOINT_INSN     0x4e4f  // trap #15
+#define SR_TRACE            0x8000
+
+#define VEC_ACCESS_FAULT    2
+#define VEC_ADDRESS_ERROR   3
+#define VEC_ILLEGAL         4
+#define VEC_ZERO_DIVIDE     5
+#define VEC_TRACE           9
+#define VEC_LINE_A          10
+#define VEC_LINE_F          11
+#define VEC_TRAP_15         47
+
+#define SIGINT              2
+#define SIGILL              4
+#define SIGTRAP             5
+#define SIGEMT              7
+#define SIGFPE              8
+#define SIGBUS              10
+#define SIGSEGV             11
+
+static char gdb_buf[GDB_BUF_SIZE];
+static bool gdb_resumed;            // GDB is waiting for a stop reply
+static const char hexchars[] = "0123456789abcdef";
+
+static struct {
+    uint32_t    addr;
+    uint16_t    insn;
+    bool        active;
+} breakpoints[GDB_MAX_BREAKPOINTS];
+
+static void
+cache_sync(void)
+{
+    __asm__ volatile (
+        "   cpusha  %%bc    \n"
+        :
+        :
+        : "memory"
+    );
+}
+
+static int
+hex_value(char c)
+{
+    switch (c) {
+    case '0'...'9':
+        return c - '0';
+    case 'a' ... 'f':
+        return c - 'a' + 10;
+    case 'A' ... 'F':
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// parse a hex number, advancing the pointer
+static uint32_t
+parse_hex(const char **pp)
+{
+    const char *p = *pp;
+    uint32_t v = 0;
+    int x;
+
+    while ((x = hex_value(*p)) >= 0) {
+        v = (v << 4) | x;
+        p++;
+    }
+    *pp = p;
+    return v;
+}
+
+static char *
+put_hex8(char *p, uint8_t v)
+{
+    *p++ = hexchars[v >> 4];
+    *p++ = hexchars[v & 0xf];
+    return p;
+}
+
+static char *
+put_hex32(char *p, uint32_t v)
+{
+    p = put_hex8(p, v >> 24);
+    p = put_hex8(p, v >> 16);
+    p = put_hex8(p, v >> 8);
+    return put_hex8(p, v);
+}
+
+// Receive a packet into gdb_buf, acknowledging it; returns length.
+static uint32_t
+gdb_get_packet(void)
+{
+    for (;;) {
+        while (getc() != '$') {
+        }
+    restart:;
+        uint32_t len = 0;
+        uint8_t sum = 0;
+        for (;;) {
+            const char c = getc();
+            if (c == '$') {
+                goto restart;
+            }
+            if (c == '#') {
+                break;
+            }
+            sum += c;
+            if (len < (GDB_BUF_SIZE - 1)) {
+                gdb_buf[len++] = c;
+            }
+        }
+        const int hi = hex_value(getc());
+        const int lo = hex_value(getc());
+        if ((hi >= 0) && (lo >= 0) && (((hi << 4) | lo) == sum)) {
+            uart_write(UART_CONSOLE, "+", 1);
+            gdb_buf[len] = '\0';
+            return len;
+        }
+        uart_write(UART_CONSOLE, "-", 1);
+    }
+}
+
+// Send gdb_buf[0..len) as a packet, retrying until acknowledged.
+static void
+gdb_put_packet(uint32_t len)
+{
+    uint8_t sum = 0;
+    char trailer[3];
+
+    for (uint32_t i = 0; i < len; i++) {
+        sum += gdb_buf[i];
+    }
+    trailer[0] = '#';
+    put_hex8(&trailer[1], sum);
+    do {
+        uart_write(UART_CONSOLE, "$", 1);
+        uart_write(UART_CONSOLE, gdb_buf, len);
+        uart_write(UART_CONSOLE, trailer, sizeof(trailer));
+    } while (getc() != '+');
+}
+
+static void
+gdb_reply(const char *s)
+{
+    uint32_t len = 0;
+
+    while (*s) {
+        gdb_buf[len++] = *s++;
+    }
+    gdb_put_packet(len);
+}
+
+static uint32_t
+gdb_signal(const frame_t *frame)
+{
+    switch (frame->vector / 4) {
+    case VEC_ACCESS_FAULT:
+        return SIGSEGV;
+    case VEC_ADDRESS_ERROR:
+        return SIGBUS;
+    case VEC_ILLEGAL:
+    case VEC_LINE_A:
+    case VEC_LINE_F:
+        return SIGILL;
+    case VEC_ZERO_DIVIDE:
+        return SIGFPE;
+    case VEC_TRACE:
+    case VEC_TRAP_15:
+        return SIGTRAP;
+    case 24 ... 31:
+        return SIGINT;
+    }
+    return SIGEMT;
+}
+
+static uint32_t *
+gdb_reg(regs_t *regs, uint32_t n)
+{
+    if (n < 8) {
+        return &regs->d[n];
+    }
+    if (n < 15) {
+        return &regs->a[n - 8];
+    }
+    return NULL;
+}
+
+static uint32_t
+gdb_get_reg(regs_t *regs, uint32_t n)
+{
+    frame_t *frame = (frame_t *)(regs + 1);
+
+    switch (n) {
+    case 15:
+        return (uint32_t)frame + frame_size(frame);
+    case 16:
+        return frame->sr;
+    case 17:
+        return frame->pc;
+    }
+    return *gdb_reg(regs, n);
+}
+
+// The stack pointer is implied by the frame location and can't be set.
+static void
+gdb_set_reg(regs_t *regs, uint32_t n, uint32_t value)
+{
+    frame_t *frame = (frame_t *)(regs + 1);
+
+    switch (n) {
+    case 15:
+        break;
+    case 16:
+        frame->sr = value;
+        break;
+    case 17:
+        frame->pc = value;
+        break;
+    default:
+        *gdb_reg(regs, n) = value;
+        break;
+    }
+}
+
+static void
+gdb_read_memory(const char *p)
+{
+    const uint32_t addr = parse_hex(&p);
+    uint32_t len = (*p == ',') ? (p++, parse_hex(&p)) : 0;
+
+    // read raw bytes into the top half of the buffer, then expand
+    if (len > ((GDB_BUF_SIZE - 1) / 2)) {
+        len = (GDB_BUF_SIZE - 1) / 2;
+    }
+    uint8_t *raw = (uint8_t *)gdb_buf + len;
+    if (!safe_copy(raw, (const void *)addr, len)) {
+        gdb_reply("E14");
+        return;
+    }
+    char *out = gdb_buf;
+    for (uint32_t i = 0; i < len; i++) {
+        out = put_hex8(out, raw[i]);
+    }
+    gdb_put_packet(len * 2);
+}
+
+// M addr,len:hex or X addr,len:binary
+static void
+gdb_write_memory(const char *p, uint32_t packet_len, bool binary)
+{
+    const uint32_t addr = parse_hex(&p);
+    const uint32_t len = (*p == ',') ? (p++, parse_hex(&p)) : 0;
+    if (*p++ != ':') {
+        gdb_reply("E01");
+        return;
+    }
+
+    // decode in place
+    const char *end = gdb_buf + packet_len;
+    uint8_t *out = (uint8_t *)gdb_buf;
+    uint32_t count = 0;
+    while ((count < len) && (p < end)) {
+        if (binary) {
+            uint8_t c = *p++;
+            if ((c == 0x7d) && (p < end)) {
+                c = *p++ ^ 0x20;
+            }
+            *out++ = c;
+        } else {
+            const int hi = hex_value(*p++);
+            const int lo = hex_value(*p++);
+            *out++ = (hi << 4) | lo;
+        }
+        count++;
+    }
+    if ((count != len) || !safe_copy((void *)addr, gdb_buf, len)) {
+        gdb_reply("E14");
+        return;
+    }
+    cache_sync();
+    gdb_reply("OK");
+}
+
+static bool
+gdb_breakpoint(const char *p, bool insert)
+{
+    if (*p++ != '0') {
+        return false;
+    }
+    p++;
+    const uint32_t addr = parse_hex(&p);
+
+    for (int i = 0; i < GDB_MAX_BREAKPOINTS; i++) {
+        if (insert && !breakpoints[i].active) {
+            const uint16_t insn = BREAKPOINT_INSN;
+            if (!safe_copy(&breakpoints[i].insn, (const void *)addr, sizeof(insn)) ||
+                !safe_copy((void *)addr, &insn, sizeof(insn))) {
+                return false;
+            }
+            breakpoints[i].addr = addr;
+            breakpoints[i].active = true;
+            cache_sync();
+            return true;
+        }
+        if (!insert && breakpoints[i].active && (breakpoints[i].addr == addr)) {
+            breakpoints[i].active = false;
+            safe_copy((void *)addr, &breakpoints[i].insn, sizeof(breakpoints[i].insn));
+            cache_sync();
+            return true;
+        }
+    }
+    return false;
+}
+
+// True if the exception was caused by the debugger.
+bool
+gdb_trap(const frame_t *frame)
+{
+    switch (frame->vector / 4) {
+    case VEC_TRACE:
+    case VEC_TRAP_15:
+        return true;
+    }
+    return false;
+}
+
+// Talk to GDB until told to resume; returns to _sleh, which resumes
+// the interrupted context.
+void
+gdb_stub(regs_t *regs)
+{
+    frame_t *frame = (frame_t *)(regs + 1);
+    char *out;
+
+    frame->sr &= ~SR_TRACE;
+
+    // if GDB resumed us, report why we stopped; otherwise it will ask
+    if (gdb_resumed) {
+        out = put_hex8(gdb_buf + 1, gdb_signal(frame));
+        gdb_buf[0] = 'S';
+        gdb_put_packet(out - gdb_buf);
+    }
+
+    for (;;) {
+        const uint32_t len = gdb_get_packet();
+        const char *p = gdb_buf + 1;
+        uint32_t n;
+
+        switch (gdb_buf[0]) {
+        case '?':
+            out = put_hex8(gdb_buf + 1, gdb_signal(frame));
+            gdb_buf[0] = 'S';
+            gdb_put_packet(out - gdb_buf);
+            break;
+        case 'g':
+            out = gdb_buf;
+            for (n = 0; n < GDB_NUM_REGS; n++) {
+                out = put_hex32(out, gdb_get_reg(regs, n));
+            }
+            gdb_put_packet(out - gdb_buf);
+            break;
+        case 'G':
+            for (n = 0; (n < GDB_NUM_REGS) && ((p + 8) <= (gdb_buf + len)); n++) {
+                uint32_t value = 0;
+                for (int i = 0; i < 8; i++) {
+                    value = (value << 4) | hex_value(*p++);
+                }
+                gdb_set_reg(regs, n, value);
+            }
+            gdb_reply("OK");
+            break;
+        case 'p':
+            n = parse_hex(&p);
+            if (n >= GDB_NUM_REGS) {
+                gdb_reply("E01");
+                break;
+            }
+            out = put_hex32(gdb_buf, gdb_get_reg(regs, n));
+            gdb_put_packet(out - gdb_buf);
+            break;
+        case 'P':
+            n = parse_hex(&p);
+            if ((n >= GDB_NUM_REGS) || (*p++ != '=')) {
+                gdb_reply("E01");
+                break;
+            }
+            gdb_set_reg(regs, n, parse_hex(&p));
+            gdb_reply("OK");
+            break;
+        case 'm':
+            gdb_read_memory(p);
+            break;
+        case 'M':
+            gdb_write_memory(p, len, false);
+            break;
+        case 'X':
+            gdb_write_memory(p, len, true);
+            break;
+        case 'Z':
+        case 'z':
+            if (gdb_breakpoint(p, gdb_buf[0] == 'Z')) {
+                gdb_reply("OK");
+            } else {
+                gdb_reply("");
+            }
+            break;
+        case 's':
+        case 'c':
+            if (*p) {
+                frame->pc = parse_hex(&p);
+            }
+            if (gdb_buf[0] == 's') {
+                frame->sr |= SR_TRACE;
+            }
+            gdb_resumed = true;
+            cache_sync();
+            return;
+        case 'D':
+            gdb_reply("OK");
+            // FALLTHROUGH
+        case 'k':
+            gdb_resumed = false;
+            cache_sync();
+            return;
+        case 'H':
+            gdb_reply("OK");
+            break;
+        case 'q':
+            if ((gdb_buf[1] == 'S') && (gdb_buf[2] == 'u')) {      // qSupported
+                gdb_reply("PacketSize=3ff");
+            } else if ((gdb_buf[1] == 'A') && (gdb_buf[2] == 't')) { // qAttached
+                gdb_reply("1");
+            } else {
+                gdb_reply("");
+            }
+            break;
+        default:
+            gdb_reply("");
+            break;
+        }
+    }
+}
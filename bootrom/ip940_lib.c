@@ -3,187 +3,251 @@
  */
 
 #include <stdbool.h>
-#include <stdarg.h>
 #include <stddef.h>
 
 #include "ip940_lib.h"
 
 // stdio //////////////////////////////////////////////////////////////////////
 
-// OX16C954 quad UART on baseboard
+// OX16C954 quad UART on baseboard, channels 0x20 apart
 #define QUART_BASE      0x02110000
-#define QUART_THR       *((volatile uint8_t *)(QUART_BASE+(0x00<<2)+3))
-#define QUART_RHR       *((volatile uint8_t *)(QUART_BASE+(0x00<<2)+3))
-#define QUART_DLL       *((volatile uint8_t *)(QUART_BASE+(0x00<<2)+3))
-#define QUART_DLM       *((volatile uint8_t *)(QUART_BASE+(0x01<<2)+3))
-#define QUART_FCR       *((volatile uint8_t *)(QUART_BASE+(0x02<<2)+3))
-#define QUART_EFR       *((volatile uint8_t *)(QUART_BASE+(0x02<<2)+3))
-#define QUART_LCR       *((volatile uint8_t *)(QUART_BASE+(0x03<<2)+3))
-#define QUART_LSR       *((volatile uint8_t *)(QUART_BASE+(0x05<<2)+3))
-#define QUART_ICR       *((volatile uint8_t *)(QUART_BASE+(0x05<<2)+3))
-#define QUART_SPR       *((volatile uint8_t *)(QUART_BASE+(0x07<<2)+3))
+#define QUART_REG(_ch, _reg) \
+                        *((volatile uint8_t *)(QUART_BASE+((_ch)<<5)+((_reg)<<2)+3))
+#define QUART_THR(_ch)  QUART_REG(_ch, 0x00)
+#define QUART_RHR(_ch)  QUART_REG(_ch, 0x00)
+#define QUART_DLL(_ch)  QUART_REG(_ch, 0x00)
+#define QUART_DLM(_ch)  QUART_REG(_ch, 0x01)
+#define QUART_FCR(_ch)  QUART_REG(_ch, 0x02)
+#define QUART_EFR(_ch)  QUART_REG(_ch, 0x02)
+#define QUART_LCR(_ch)  QUART_REG(_ch, 0x03)
+#define QUART_LSR(_ch)  QUART_REG(_ch, 0x05)
+#define QUART_ICR(_ch)  QUART_REG(_ch, 0x05)
+#define QUART_SPR(_ch)  QUART_REG(_ch, 0x07)
+#define QUART_FIFO_SIZE 128     // in 950 mode
 
-static void
-quart_init(void)
-{
-    QUART_FCR = 1;          // enable FIFO, 550/extended mode
-    QUART_LCR = 0xbf;       // enable extended registers, divisor latch
-    QUART_EFR = 0x50;       // enable 950 mode, auto RTS
-    QUART_LCR = 0x80;       // enable divisor latch
-    QUART_DLM = 0;
-    QUART_DLL = 5;          // divisor / 5
-    QUART_LCR = 0x03;       // clear divisor latch, set n81
-    QUART_SPR = 1;          // select CPR
-    QUART_ICR = 29;         // prescale 3.625
-}
+#define LSR_RXRDY       0x01
+#define LSR_THRE        0x20
+#define LSR_TEMT        0x40
+
+// divisor and 5.3 prescaler for the 33.333MHz clock, see brg.py
+static const struct {
+    uint32_t    rate;
+    uint8_t     dll;
+    uint8_t     cpr;
+} quart_rates[] = {
+    { 115200,   5,  29 },
+    { 921600,   1,  18 },
+};
+
+// Transmit data is queued in a per-channel ring and moved to the FIFO
+// whenever there is room; the ring is drained by writers, by any wait
+// loop and by the timer tick, so output rarely blocks the caller.
+// Rings are allocated from the arena.
+#define TX_RING_SIZE    256     // power of 2
+
+static struct {
+    volatile uint16_t   head;
+    volatile uint16_t   tail;
+    uint8_t             *ring;
+} quart_tx[UART_CHANNELS];
+
+// There is no receive ring: with no receive interrupt it could only be
+// filled from the same polls that read the 128-byte FIFO, and auto-RTS
+// already holds the sender off when the FIFO fills. Receive waits poll
+// for a while before idling the CPU, since during a transfer the next
+// byte is usually close behind.
+#define UART_SPIN       1000
+#define UART_WAIT_POLLS 5000    // polls per tick, for timeouts without the timer
+
+uint32_t data_port = UART_DATA;
 
 void
-putc(char c)
+uart_init(uint32_t ch, uint32_t rate)
 {
-    if (c == '\n') {
-        putc('\r');
-    }
-    while ((QUART_LSR & (1 << 5)) == 0) {}
-    QUART_THR = c;
+    uint32_t i = 0;
 
-    // wait for FIFO drain on newline
-    while ((c == '\n') && ((QUART_LSR & 0x40) == 0)) {}
+    while ((i < (sizeof(quart_rates) / sizeof(quart_rates[0])) - 1) &&
+           (quart_rates[i].rate != rate)) {
+        i++;
+    }
+    QUART_FCR(ch) = 1;          // enable FIFO, 550/extended mode
+    QUART_LCR(ch) = 0xbf;       // enable extended registers, divisor latch
+    // enable 950 mode and auto RTS; auto CTS only off the console, so
+    // that a 3-wire console cable still works
+    QUART_EFR(ch) = (ch == UART_CONSOLE) ? 0x50 : 0xd0;
+    QUART_LCR(ch) = 0x80;       // enable divisor latch
+    QUART_DLM(ch) = 0;
+    QUART_DLL(ch) = quart_rates[i].dll;
+    QUART_LCR(ch) = 0x03;       // clear divisor latch, set n81
+    QUART_SPR(ch) = 1;          // select CPR
+    QUART_ICR(ch) = quart_rates[i].cpr;
+    quart_tx[ch].head = 0;
+    quart_tx[ch].tail = 0;
 }
 
 static void
-putx8(uint8_t x)
+quart_init(void)
 {
-    static const char xtab[] = "0123456789abcdef";
-
-    putc(xtab[(x >> 4) & 0xf]);
-    putc(xtab[x & 0xf]);
+    for (uint32_t ch = 0; ch < UART_CHANNELS; ch++) {
+        quart_tx[ch].ring = arena_alloc(TX_RING_SIZE);
+    }
+    uart_init(UART_CONSOLE, 115200);
+    if (data_port != UART_CONSOLE) {
+        uart_init(data_port, 921600);
+    }
 }
 
+// Move queued data to the FIFO if it has emptied; interrupts masked.
 static void
-putx32(uint32_t x)
+uart_pump(uint32_t ch)
 {
-    putx8(x >> 24);
-    putx8(x >> 16);
-    putx8(x >>  8);
-    putx8(x);
+    if ((quart_tx[ch].head != quart_tx[ch].tail) &&
+        (QUART_LSR(ch) & LSR_THRE)) {
+        uint32_t tail = quart_tx[ch].tail;
+        for (uint32_t n = 0; (n < QUART_FIFO_SIZE) && (tail != quart_tx[ch].head); n++) {
+            QUART_THR(ch) = quart_tx[ch].ring[tail];
+            tail = (tail + 1) & (TX_RING_SIZE - 1);
+        }
+        quart_tx[ch].tail = tail;
+    }
 }
 
-static void
-putd(uint32_t x)
+// Drain all transmit rings as far as the FIFOs allow.
+void
+uart_poll(void)
 {
-    uint32_t div = 1000000000LU;
-    bool need_zero = false;
+    const uint16_t sr = get_sr();
 
-    do {
-        if (x >= div) {
-            putc('0' + (x / div));
-            x = x % div;
-            need_zero = true;
-        } else if (need_zero || (div == 1)) {
-            putc('0');
-        }
-        div /= 10;
-    } while (div > 0);
+    set_sr(sr | 0x0700);
+    for (uint32_t ch = 0; ch < UART_CHANNELS; ch++) {
+        uart_pump(ch);
+    }
+    set_sr(sr);
 }
 
 void
-print(const char *fmt, ...)
-{
-    const char *p = fmt;
-    bool formatting = false;
-    va_list ap;
-
-    va_start(ap, fmt);
-    while (*p) {
-        const char c = *p++;
-        if (!formatting) {
-            if (c == '%') {
-                formatting = true;
-            } else {
-                putc(c);
-            }
-            continue;
-        }
-        switch (c) {
-        case 'd':
-            putd(va_arg(ap, uint32_t));
-            break;
-        case 'b':
-            putc('0');
-            putc('x');
-            putx8(va_arg(ap, uint32_t));
-            break;
-        case 'x':
-            putc('0');
-            putc('x');
-            putx32(va_arg(ap, uint32_t));
-            break;
-        case 's':
-            print(va_arg(ap, char *));
-            break;
+uart_write(uint32_t ch, const void *buf, uint32_t len)
+{
+    const uint8_t *p = buf;
+
+    while (len > 0) {
+        const uint16_t sr = get_sr();
+        set_sr(sr | 0x0700);
+        uint32_t head = quart_tx[ch].head;
+        while ((len > 0) && (((head + 1) & (TX_RING_SIZE - 1)) != quart_tx[ch].tail)) {
+            quart_tx[ch].ring[head] = *p++;
+            head = (head + 1) & (TX_RING_SIZE - 1);
+            len--;
         }
-        formatting = false;
+        quart_tx[ch].head = head;
+        uart_pump(ch);
+        set_sr(sr);
     }
-    va_end(ap);
 }
 
-static bool
-checkc(void)
+// Wait until everything queued for the channel has been sent.
+void
+uart_flush(uint32_t ch)
+{
+    while (quart_tx[ch].head != quart_tx[ch].tail) {
+        uart_poll();
+    }
+    while ((QUART_LSR(ch) & LSR_TEMT) == 0) {}
+}
+
+void
+putc(char c)
 {
-    return (QUART_LSR & 1) == 1;
+    if (c == '\n') {
+        putc('\r');
+    }
+    uart_write(UART_CONSOLE, &c, 1);
+}
+
+void
+putraw(const void *buf, uint32_t len)
+{
+    uart_write(data_port, buf, len);
+}
+
+bool
+uart_ready(uint32_t ch)
+{
+    return (QUART_LSR(ch) & LSR_RXRDY) != 0;
 }
 
 int
-getc(void)
+uart_getc(uint32_t ch)
 {
-    while (!checkc()) {
+    for (uint32_t spin = 0; !uart_ready(ch); spin++) {
+        uart_poll();
+        if (spin >= UART_SPIN) {
+            cpu_idle();
+        }
+    }
+    return QUART_RHR(ch);
+}
+
+void
+uart_read(uint32_t ch, void *buf, uint32_t len)
+{
+    uint8_t *p = buf;
+
+    while (len--) {
+        *p++ = uart_getc(ch);
     }
-    return QUART_RHR;
 }
 
+// Discard pending input, then wait for a character; ticks == 0 waits
+// forever. If the tick can't be used (a program has stopped the timer
+// or masked interrupts) the timeout is counted in polls instead, and
+// the timer is left alone.
 bool
-waitc(uint32_t ticks)
+uart_wait(uint32_t ch, uint32_t ticks)
 {
-    while (checkc()) {
-        (void)getc();
+    const bool ticking = timer_ticking();
+    uint32_t polls = ticks * UART_WAIT_POLLS;
+
+    while (uart_ready(ch)) {
+        (void)QUART_RHR(ch);
     }
-    if (ticks) {
+    if (ticks && ticking) {
         timer_start(ticks);
     }
-    while (!checkc()) {
-        if (ticks && (timer_count == 0)) {
+    for (uint32_t spin = 0; !uart_ready(ch); spin++) {
+        uart_poll();
+        if (ticks && (ticking ? (timer_count == 0) : (--polls == 0))) {
             return false;
         }
+        if (spin >= UART_SPIN) {
+            cpu_idle();
+        }
     }
     return true;
 }
 
+int
+getc(void)
+{
+    return uart_getc(UART_CONSOLE);
+}
+
+void
+getraw(void *buf, uint32_t len)
+{
+    uart_read(data_port, buf, len);
+}
+
 bool
-askyn(uint32_t ticks)
+waitc(uint32_t ticks)
 {
-    print("(Y/N) ");
-    for (;;) {
-        if (!waitc(ticks)) {
-            print("timeout \n");
-            return false;
-        }
-        switch (getc()) {
-        case 'y':
-        case 'Y':
-            print("Y\n");
-            return true;
-        case 'n':
-        case 'N':
-            print("N\n");
-            return false;
-        }
-    }
+    return uart_wait(UART_CONSOLE, ticks);
 }
 
 static uint32_t
-getx4(void)
+getx4(uint32_t ch)
 {
-    const char c = getc();
+    const char c = uart_getc(ch);
     switch (c) {
     case '0'...'9':
         return c - '0';
@@ -196,60 +260,522 @@ getx4(void)
 }
 
 uint32_t
-getx8(void)
+getx8(uint32_t ch)
 {
-    uint8_t r = getx4();
-    return (r << 4) | getx4();
+    uint8_t r = getx4(ch);
+    return (r << 4) | getx4(ch);
 }
 
 uint32_t
-getx32(void)
+getx32(uint32_t ch)
+{
+    uint32_t r = getx8(ch);
+    r = (r << 8) | getx8(ch);
+    r = (r << 8) | getx8(ch);
+    return (r << 8) | getx8(ch);
+}
+
+// formatted output ///////////////////////////////////////////////////////////
+
+// Lines longer than the buffer are queued in pieces.
+#define FMT_BUF_SIZE    128
+
+static char fmt_buf[FMT_BUF_SIZE];
+static uint32_t fmt_len;
+static const char xtab[] = "0123456789abcdef";
+
+static inline void
+fmt_char(char c)
+{
+    if (fmt_len == FMT_BUF_SIZE) {
+        fmt_end();
+    }
+    fmt_buf[fmt_len++] = c;
+}
+
+void
+fmt_begin(void)
+{
+    fmt_len = 0;
+}
+
+void
+fmt_end(void)
 {
-    uint32_t r = getx8();
-    r = (r << 8) | getx8();
-    r = (r << 8) | getx8();
-    return (r << 8) | getx8();
+    uart_write(UART_CONSOLE, fmt_buf, fmt_len);
+    fmt_len = 0;
+}
+
+void
+fmt_str(const char *s)
+{
+    while (*s) {
+        if (*s == '\n') {
+            fmt_char('\r');
+        }
+        fmt_char(*s++);
+    }
+}
+
+// Divide-free; x / 10 is a multiply by the reciprocal (2^35 / 10),
+// exact for all 32-bit x.
+void
+fmt_dec(fmt_dec_t x)
+{
+    char digits[10];
+    uint32_t n = 0;
+    uint32_t v = x.v;
+
+    do {
+        const uint32_t q = ((uint64_t)v * 0xcccccccdU) >> 35;
+        digits[n++] = '0' + (v - (q * 10));
+        v = q;
+    } while (v != 0);
+    while (n > 0) {
+        fmt_char(digits[--n]);
+    }
+}
+
+void
+fmt_hex(fmt_hex_t x)
+{
+    fmt_char('0');
+    fmt_char('x');
+    for (int shift = 28; shift >= 0; shift -= 4) {
+        fmt_char(xtab[(x.v >> shift) & 0xf]);
+    }
+}
+
+void
+fmt_hex8(fmt_hex8_t x)
+{
+    fmt_char('0');
+    fmt_char('x');
+    fmt_char(xtab[x.v >> 4]);
+    fmt_char(xtab[x.v & 0xf]);
+}
+
+// memory /////////////////////////////////////////////////////////////////////
+
+// _reset sizes DRAM and relocates the loader to the top of it. Buffers
+// the loader needs are carved from an arena growing down from there,
+// so all DRAM below arena_limit() is contiguous and free for programs.
+// Allocations are never freed.
+uint32_t dram_end;                  // set by _start
+uint32_t loader_base;
+static uint32_t arena_top;
+
+// Allocate from the arena, aligned for MOVE16.
+void *
+arena_alloc(uint32_t size)
+{
+    arena_top = (arena_top - size) & ~15UL;
+    return (void *)arena_top;
+}
+
+uint32_t
+arena_limit(void)
+{
+    return arena_top;
 }
 
 // timer //////////////////////////////////////////////////////////////////////
 
-volatile uint32_t timer_count;
+volatile uint32_t timer_count;      // countdown for timeouts
+volatile uint32_t timer_ticks;      // timebase, ticks since boot
+static bool timer_running;
 #define TIMER_STOP  *(volatile uint8_t *)0x0210003b
 #define TIMER_START *(volatile uint8_t *)0x0210003f
 
+uint32_t *profile_table;             // also tested by vector_ipl6
+
+// The timer runs freely from startup until control is handed to a
+// program that doesn't return.
 __attribute__((interrupt))
 void
 vector_ipl4(void)
 {
     // 50Hz timer
+    uart_poll();
+    timer_ticks++;
     if (timer_count != 0) {
-        if (--timer_count == 0) {
-            TIMER_STOP = 1;
-        }
+        timer_count--;
     }
 }
 
-__attribute__((interrupt))
-void
-vector_ipl6(void)
-{
-    // ignore the 200Hz timer
-}
-
+// Set the timeout countdown (if ticks > 0) and make sure the timer is
+// running.
 void
 timer_start(uint32_t ticks)
 {
-    timer_stop();
     if (ticks > 0) {
         timer_count = ticks;
     }
     TIMER_START = 1;
+    timer_running = true;
 }
 
 void
 timer_stop(void)
 {
     TIMER_STOP = 1;
+    timer_running = false;
+}
+
+uint32_t
+timer_uptime(void)
+{
+    return timer_ticks;
+}
+
+// True if the tick is running and can be taken, so that waits can be
+// timed by it.
+bool
+timer_ticking(void)
+{
+    return timer_running && ((get_sr() & 0x0700) == 0);
+}
+
+// Sleep until the next interrupt; the 200Hz and 50Hz ticks bound the
+// wait. Does nothing if the timer is stopped or interrupts are masked,
+// as the caller would never be woken.
+void
+cpu_idle(void)
+{
+    if (timer_ticking()) {
+        __asm__ volatile ("stop #0x2000" : : : "memory");
+    }
+}
+
+// tasks //////////////////////////////////////////////////////////////////////
+
+static task_t *tasks[TASKS_MAX];
+
+// Start a task from the top; ignored if it is already running. The
+// function is set here, since the loader can't have addresses in
+// initialised data.
+void
+task_add(task_t *task, uint8_t (*run)(task_t *task))
+{
+    uint32_t free = TASKS_MAX;
+
+    for (uint32_t i = 0; i < TASKS_MAX; i++) {
+        if (tasks[i] == task) {
+            return;
+        }
+        if ((tasks[i] == NULL) && (free == TASKS_MAX)) {
+            free = i;
+        }
+    }
+    if (free == TASKS_MAX) {
+        PRINT("!! too many tasks\n");
+        return;
+    }
+    task->lc = 0;
+    task->run = run;
+    tasks[free] = task;
+}
+
+bool
+task_active(const task_t *task)
+{
+    for (uint32_t i = 0; i < TASKS_MAX; i++) {
+        if (tasks[i] == task) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Keeps the transmit rings moving between ticks.
+static uint8_t
+uart_task_run(task_t *task)
+{
+    uart_poll();
+    return TASK_WAITING;
+}
+
+static task_t uart_task;
+
+// Run tasks until the end of time, idling whenever none has work.
+void
+task_run(void)
+{
+    task_add(&uart_task, uart_task_run);
+    for (;;) {
+        bool busy = false;
+        for (uint32_t i = 0; i < TASKS_MAX; i++) {
+            task_t *const task = tasks[i];
+            if (task == NULL) {
+                continue;
+            }
+            switch (task->run(task)) {
+            case TASK_YIELDED:
+                busy = true;
+                break;
+            case TASK_EXITED:
+                tasks[i] = NULL;
+                busy = true;
+                break;
+            }
+        }
+        if (!busy) {
+            cpu_idle();
+        }
+    }
+}
+
+// crc ////////////////////////////////////////////////////////////////////////
+
+// IEEE 802.3 CRC32, compatible with zlib's crc32(); pass 0 to start.
+// The byte-wise table is built on first use.
+static uint32_t crctab[256];
+
+uint32_t
+crc32(uint32_t crc, const void *buf, uint32_t len)
+{
+    const uint8_t *p = buf;
+
+    if (crctab[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int bit = 0; bit < 8; bit++) {
+                c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+            }
+            crctab[i] = c;
+        }
+    }
+    crc = ~crc;
+    while (len--) {
+        crc = (crc >> 8) ^ crctab[(crc ^ *p++) & 0xff];
+    }
+    return ~crc;
+}
+
+// warm reset /////////////////////////////////////////////////////////////////
+
+// Describes the last program run from DRAM. Kept in .noinit so that it
+// survives reset, allowing the program to be re-run without uploading
+// it again as long as it has not modified its loaded image.
+#define WARM_MAGIC  0x49503934      // 'IP94'
+
+static struct {
+    uint32_t    magic;
+    uint32_t    resets;             // resets since power-on
+    image_t     image;
+    uint32_t    image_crc;
+    uint32_t    check;              // CRC of the fields above
+} warm_state __attribute__((section(".noinit")));
+
+static uint32_t
+warm_check(void)
+{
+    return crc32(0, &warm_state, offsetof(typeof(warm_state), check));
+}
+
+// Validate the warm state; on a cold boot, reset it. Returns the
+// number of resets since power-on.
+uint32_t
+warm_reset_count(void)
+{
+    if ((warm_state.magic == WARM_MAGIC) && (warm_state.check == warm_check())) {
+        warm_state.resets++;
+    } else {
+        warm_state.magic = WARM_MAGIC;
+        warm_state.resets = 0;
+        warm_state.image.entry = 0;
+    }
+    warm_state.check = warm_check();
+    return warm_state.resets;
+}
+
+// True after a warm reset if a program was run before it; its image
+// may still be intact.
+bool
+warm_recorded(void)
+{
+    return (warm_state.resets != 0) && (warm_state.image.entry != 0);
+}
+
+static void
+warm_record(const image_t *image)
+{
+    warm_state.image = *image;
+    warm_state.image_crc = crc32(0,
+                                 (const void *)image->load_base,
+                                 image->load_limit - image->load_base);
+    warm_state.check = warm_check();
+}
+
+// Returns true, with the image re-initialised, if the last program run
+// is still intact in DRAM.
+bool
+warm_image(image_t *image)
+{
+    *image = warm_state.image;
+    if ((warm_state.resets == 0) ||
+        (image->entry == 0) ||
+        (crc32(0,
+               (const void *)image->load_base,
+               image->load_limit - image->load_base) != warm_state.image_crc)) {
+        return false;
+    }
+    for (uint8_t *p = (uint8_t *)image->bss_base; p < (uint8_t *)image->bss_limit; p++) {
+        *p = 0;
+    }
+    return true;
+}
+
+// profiler ///////////////////////////////////////////////////////////////////
+
+// Statistical PC sampler driven by the 200Hz timer. Samples are counted
+// in buckets of (1 << profile_shift) bytes covering [profile_base,
+// profile_limit). The table lives just below the arena so that it
+// survives the program being profiled.
+#define PROFILE_BUCKETS_MAX 16384
+
+bool profile_armed;                 // profile the next program run
+static uint32_t profile_base;
+static uint32_t profile_limit;
+static uint32_t profile_shift;
+static uint32_t profile_samples;
+static uint32_t profile_outside;
+
+void
+profile_sample(uint32_t pc)
+{
+    profile_samples++;
+    if ((pc >= profile_base) && (pc < profile_limit)) {
+        profile_table[(pc - profile_base) >> profile_shift]++;
+    } else {
+        profile_outside++;
+    }
+}
+
+__asm__(
+    "   .align 2                            \n"
+    "   .type vector_ipl6 @function         \n"
+    "   .globl vector_ipl6                  \n"
+    "vector_ipl6:                           \n" /* 200Hz timer                    */    \
+    "   tst.l   %pc@(profile_table)         \n" /* profiling?                     */    \
+    "   beq     1f                          \n" /* ... no, ignore the tick        */    \
+    "   movem.l %d0-%d1/%a0-%a1,%sp@-       \n" /* save caller-saved registers    */    \
+    "   move.l  %sp@(18),%sp@-              \n" /* push interrupted PC            */    \
+    "   bsr     profile_sample              \n" /* profile_sample(pc)             */    \
+    "   addq.l  #4, %sp                     \n" /* fix stack                      */    \
+    "   movem.l %sp@+,%d0-%d1/%a0-%a1       \n" /* restore caller-saved registers */    \
+    "1:                                     \n"                                         \
+    "   rte                                 \n"                                         \
+    );
+
+// Sample [base, limit); the program occupies memory up to image_limit.
+bool
+profile_start(uint32_t base, uint32_t limit, uint32_t image_limit)
+{
+    uint32_t shift = 2;
+    while (((limit - base) >> shift) >= PROFILE_BUCKETS_MAX) {
+        shift++;
+    }
+    const uint32_t buckets = ((limit - base) >> shift) + 1;
+    uint32_t *table = (uint32_t *)arena_limit() - buckets;
+
+    // refuse if the table would overlap the program, data and bss included
+    if ((uint32_t)table < image_limit) {
+        return false;
+    }
+    for (uint32_t i = 0; i < buckets; i++) {
+        table[i] = 0;
+    }
+    profile_base = base;
+    profile_limit = limit;
+    profile_shift = shift;
+    profile_samples = 0;
+    profile_outside = 0;
+    profile_table = table;
+    return true;
+}
+
+void
+profile_dump(void)
+{
+    uint32_t *const table = profile_table;
+
+    // stop sampling
+    if (table == NULL) {
+        return;
+    }
+    profile_table = NULL;
+
+    // one line per non-empty bucket: <bucket address> <samples>
+    PRINT("++ profile ", HEX(profile_base), "...", HEX(profile_limit - 1),
+          " bucket ", DEC(1 << profile_shift),
+          " samples ", DEC(profile_samples),
+          " outside ", DEC(profile_outside), "\n");
+    const uint32_t buckets = ((profile_limit - profile_base) >> profile_shift) + 1;
+    for (uint32_t i = 0; i < buckets; i++) {
+        if (table[i] != 0) {
+            PRINT(HEX(profile_base + (i << profile_shift)), " ", DEC(table[i]), "\n");
+        }
+    }
+    PRINT("++ end profile\n");
+}
+
+// Call a loaded program as a subroutine; it may trash any register
+// but must return with the stack intact.
+__asm__(
+    "   .align 2                            \n"
+    "   .type call_program @function        \n"
+    "   .globl call_program                 \n"
+    "call_program:                          \n"
+    "   movem.l %d2-%d7/%a2-%a6,%sp@-       \n" /* save callee-saved registers    */    \
+    "   move.l  %sp@(48),%a0                \n" /* entrypoint                     */    \
+    "   jsr     (%a0)                       \n"                                         \
+    "   movem.l %sp@+,%d2-%d7/%a2-%a6       \n" /* restore callee-saved registers */    \
+    "   rts                                 \n"                                         \
+    );
+
+// Run a loaded program; if profiling, sample its text and dump the
+// results if the program returns.
+void
+run_program(const image_t *image)
+{
+    const uint32_t entrypoint = image->entry;
+
+    warm_record(image);
+    cf_flush();
+
+    // profile with only the profiler tick enabled
+    if (profile_armed) {
+        uint32_t image_limit = image->text_limit;
+        if (image->load_limit > image_limit) {
+            image_limit = image->load_limit;
+        }
+        if (image->bss_limit > image_limit) {
+            image_limit = image->bss_limit;
+        }
+        if (profile_start(image->text_base, image->text_limit, image_limit)) {
+            PRINT("++ profiling loaded program (pc=", HEX(entrypoint), ")\n");
+            uart_flush(UART_CONSOLE);
+            set_sr(0x2500);
+            call_program(entrypoint);
+            interrupt_disable();
+            profile_dump();
+            interrupt_enable(true);
+            return;
+        }
+        PRINT("!! no room for profile table\n");
+    }
+
+    PRINT("++ jumping to loaded program (pc=", HEX(entrypoint), ")\n");
+    uart_flush(UART_CONSOLE);
+    interrupt_disable();
+    timer_stop();
+    __asm__ volatile (
+        "   jmp    (%0) \n"
+        :
+        : "a" (entrypoint)
+        : "memory"
+    );
 }
 
 // flash //////////////////////////////////////////////////////////////////////
@@ -294,153 +820,238 @@ flash_check_rom_id(void)
     return ((id0 == VENDOR_SST) && (id1 == DEVICE_39F040));
 }
 
-bool
-flash_program_page(volatile uint32_t *addr, uint32_t *buf)
+// A sector is erased and programmed a bounded amount of work per step,
+// so that other tasks keep running. Interrupts are only masked for the
+// command sequences; nothing that runs at interrupt time touches flash.
+#define FLASH_ERASE_POLLS   1666666     // erase timeout
+#define FLASH_STEP_POLLS    4096        // erase polls per step
+#define FLASH_STEP_WORDS    64          // words programmed per step
+
+enum {
+    JOB_ERASING,
+    JOB_PROGRAMMING,
+};
+
+void
+flash_job_start(flash_job_t *job, volatile uint32_t *addr, const uint32_t *buf)
 {
+    job->addr = addr;
+    job->buf = buf;
+    job->offset = 0;
+    job->polls = FLASH_ERASE_POLLS;
+    job->state = JOB_ERASING;
+
     bool state = interrupt_disable();
-    bool result = false;
-    uint32_t timeout;
-    do {
-        UNLOCK_ADDR_1 = UNLOCK_CODE_1;
-        UNLOCK_ADDR_2 = UNLOCK_CODE_2;
-        CMD_ADDR = CMD_ERASE;
-        UNLOCK_ADDR_1 = UNLOCK_CODE_1;
-        UNLOCK_ADDR_2 = UNLOCK_CODE_2;
-        *addr = CMD_SECTOR;
-        for (timeout = 1666666; timeout > 0; timeout--) {
-            if (*addr == BLANK) {
-                break;
+    UNLOCK_ADDR_1 = UNLOCK_CODE_1;
+    UNLOCK_ADDR_2 = UNLOCK_CODE_2;
+    CMD_ADDR = CMD_ERASE;
+    UNLOCK_ADDR_1 = UNLOCK_CODE_1;
+    UNLOCK_ADDR_2 = UNLOCK_CODE_2;
+    *addr = CMD_SECTOR;
+    interrupt_enable(state);
+}
+
+// Advance the job; returns FLASH_BUSY until it has finished.
+uint32_t
+flash_job_step(flash_job_t *job)
+{
+    if (job->state == JOB_ERASING) {
+        for (uint32_t n = 0; n < FLASH_STEP_POLLS; n++) {
+            if (*job->addr == BLANK) {
+                if (job->buf == NULL) {
+                    return FLASH_DONE;
+                }
+                job->state = JOB_PROGRAMMING;
+                return FLASH_BUSY;
+            }
+            if (--job->polls == 0) {
+                return FLASH_FAILED;
             }
         }
-        if (!timeout) {
-            break;
-        }
+        return FLASH_BUSY;
+    }
 
-        if (buf != NULL) {
-            for (uint32_t x = 0; x < (SECTOR_SIZE / sizeof(*addr)); x += 1) {
-                const uint32_t val = *(buf + x);
-                if (val != BLANK) {
-                    volatile uint32_t * const ptr = (addr + x);
-                    UNLOCK_ADDR_1 = UNLOCK_CODE_1;
-                    UNLOCK_ADDR_2 = UNLOCK_CODE_2;
-                    CMD_ADDR = CMD_PROGRAM;
-                    *ptr = val;
-                    for (timeout = 133; timeout > 0; timeout--) {
-                        if (*ptr == val) {
-                            break;
-                        }
-                    }
-                    if (!timeout) {
-                        break;
-                    }
+    for (uint32_t n = 0; n < FLASH_STEP_WORDS; n++) {
+        if (job->offset == (SECTOR_SIZE / sizeof(*job->addr))) {
+            return FLASH_DONE;
+        }
+        const uint32_t val = job->buf[job->offset];
+        volatile uint32_t * const ptr = job->addr + job->offset++;
+        if (val != BLANK) {
+            bool state = interrupt_disable();
+            UNLOCK_ADDR_1 = UNLOCK_CODE_1;
+            UNLOCK_ADDR_2 = UNLOCK_CODE_2;
+            CMD_ADDR = CMD_PROGRAM;
+            *ptr = val;
+            interrupt_enable(state);
+            uint32_t timeout;
+            for (timeout = 133; timeout > 0; timeout--) {
+                if (*ptr == val) {
+                    break;
                 }
             }
+            if (!timeout) {
+                return FLASH_FAILED;
+            }
         }
-        result = true;
-    } while(0);
+    }
+    return FLASH_BUSY;
+}
 
-    interrupt_enable(state);
-    return result;
+// Erase (buf == NULL) or erase and program a sector, waiting for the
+// result.
+bool
+flash_program_page(volatile uint32_t *addr, uint32_t *buf)
+{
+    flash_job_t job;
+    uint32_t result;
+
+    flash_job_start(&job, addr, buf);
+    while ((result = flash_job_step(&job)) == FLASH_BUSY) {
+    }
+    return result == FLASH_DONE;
+}
+
+// services ///////////////////////////////////////////////////////////////////
+
+services_t services __attribute__((section(".services")));
+
+// the last entry must match defs.h
+_Static_assert(offsetof(services_t, probe_map) == 88, "services_t layout changed");
+
+// Output services queue like the loader does, but programs usually run
+// with the timer stopped or interrupts masked, so nothing would drain
+// the ring after the last call; in that case wait for it to empty.
+static void
+svc_drain(uint32_t ch)
+{
+    if (!timer_running || ((get_sr() & 0x0700) != 0)) {
+        uart_flush(ch);
+    }
+}
+
+static void
+svc_putc(char c)
+{
+    putc(c);
+    svc_drain(UART_CONSOLE);
+}
+
+static void
+svc_puts(const char *s)
+{
+    PRINT(s);
+    svc_drain(UART_CONSOLE);
+}
+
+static void
+svc_uart_write(uint32_t ch, const void *buf, uint32_t len)
+{
+    uart_write(ch, buf, len);
+    svc_drain(ch);
+}
+
+static uint32_t
+svc_cf_size(void)
+{
+    return cf_sectors;
+}
+
+// The profile table sits just below the arena while a program is
+// profiled; keep the program's stack out of it.
+static uint32_t
+svc_arena_limit(void)
+{
+    return (profile_table != NULL) ? (uint32_t)profile_table : arena_limit();
+}
+
+static bool
+svc_flash_erase(uint32_t addr)
+{
+    return flash_program_page((volatile uint32_t *)addr, NULL);
 }
 
+void
+services_init(void)
+{
+    services.magic = SERVICES_MAGIC;
+    services.version = SERVICES_VERSION;
+    services.size = sizeof(services);
+    services.putc = svc_putc;
+    services.puts = svc_puts;
+    services.getc = getc;
+    services.waitc = waitc;
+    services.uart_write = svc_uart_write;
+    services.uart_ready = uart_ready;
+    services.uart_getc = uart_getc;
+    services.uart_read = uart_read;
+    services.uart_flush = uart_flush;
+    services.uptime = timer_uptime;
+    services.timer_start = timer_start;
+    services.timer_stop = timer_stop;
+    services.cf_size = svc_cf_size;
+    services.cf_read = cf_read;
+    services.cf_write = cf_write;
+    services.cf_flush = cf_flush;
+    services.flash_erase = svc_flash_erase;
+    services.flash_program = flash_program_page;
+    services.crc32 = crc32;
+    services.arena_limit = svc_arena_limit;
+    services.probe_map = probe_map;
+}
+
+__asm__(
+    "   .align 2                            \n"
+    "   .type vector_trap0 @function        \n"
+    "   .globl vector_trap0                 \n"
+    "vector_trap0:                          \n"                                         \
+    "   lea     %pc@(services),%a0          \n" /* table                          */    \
+    "   moveq   #0,%d0                      \n"                                         \
+    "   move.w  %a0@(4),%d0                 \n" /* version                        */    \
+    "   rte                                 \n"                                         \
+    );
+
 // exceptions /////////////////////////////////////////////////////////////////
 
-typedef struct __attribute__((packed)) {
-    uint16_t sr;
-    uint32_t pc;
-    uint16_t format:4;
-    uint16_t vector:12;
-    union {
-        struct {
-            uint32_t address;
-        } format_0x2;
-        struct {
-            uint32_t effective_address;
-        } format_0x3;
-        struct {
-            uint32_t effective_address;
-            uint32_t faulting_pc;
-        } format_0x4;
-        struct {
-            uint32_t effective_address;
-            uint16_t ssw;
-            uint16_t writeback_3_status;
-            uint16_t writeback_2_status;
-            uint16_t writeback_1_status;
-            uint32_t fault_address;
-            uint32_t writeback_3_address;
-            uint32_t writeback_3_data;
-            uint32_t writeback_2_address;
-            uint32_t writeback_2_data;
-            uint32_t writeback_1_address;
-            uint32_t writeback_1_data;
-            uint32_t push_data_1;
-            uint32_t push_data_2;
-            uint32_t push_data_3;
-        } format_0x7;
-        struct {
-            uint16_t ssw;
-            uint32_t fault_address;
-            uint16_t :16;
-            uint16_t output_buffer;
-            uint16_t :16;
-            uint16_t input_buffer;
-            uint16_t :16;
-            uint16_t instruction_buffer;
-            uint16_t internal[16];
-        } format_0x8;
-        struct {
-            uint32_t instruction_address;
-            uint16_t internal[4];
-        } format_0x9;
-        struct {
-            uint16_t internal_0;
-            uint16_t ssw;
-            uint16_t instruction_pipe_c;
-            uint16_t instruction_pipe_b;
-            uint32_t data_fault_address;
-            uint16_t internal_1;
-            uint16_t internal_2;
-            uint32_t data_output_buffer;
-            uint16_t internal_3;
-            uint16_t internal_4;
-        } format_0xa;
-        struct {
-            uint16_t internal_0;
-            uint16_t ssw;
-            uint16_t instruction_pipe_c;
-            uint16_t instruction_pipe_b;
-            uint32_t data_fault_address;
-            uint16_t internal_1;
-            uint16_t internal_2;
-            uint32_t data_output_buffer;
-            uint16_t internal_3[4];
-            uint32_t stage_b_address;
-            uint16_t internal_4[2];
-            uint32_t data_input_buffer;
-            uint16_t internal_5[3];
-            uint16_t version:4;
-            uint16_t internal_6:12;
-            uint16_t internal_7[18];
-        } format_0xb;
-        struct {
-            uint32_t faulted_address;
-            uint32_t data_buffer;
-            uint32_t current_pc;
-            uint16_t internal_xfer_count;
-            uint16_t subformat:2;
-            uint16_t ssw:14;
-        } format_0xc;
+// Size of the exception frame for each format, used to recover the
+// stack pointer at the time of the exception.
+uint32_t
+frame_size(const frame_t *frame)
+{
+    static const uint8_t sizes[16] = {
+        8, 8, 12, 12, 16, 0, 0, 60, 58, 20, 32, 92, 24, 0, 0, 0
     };
-} frame_t;
+    return sizes[frame->format];
+}
+
+// Resume address for an expected access fault, see safe_copy().
+uint32_t fault_resume;
 
 void
-_sleh(frame_t *frame)
+_sleh(regs_t *regs)
 {
-    print("Exception %d @ %x\n", frame->vector / 4, frame->pc);
-    for (;;) {
-        stop();
+    frame_t *frame = (frame_t *)(regs + 1);
+
+    // expected access fault; abandon the access and resume at the
+    // recovery point, discarding any pending writebacks
+    if (fault_resume && ((frame->vector / 4) == 2)) {
+        frame->pc = fault_resume;
+        fault_resume = 0;
+        if (frame->format == 0x7) {
+            frame->format_0x7.writeback_1_status &= ~0x80;
+            frame->format_0x7.writeback_2_status &= ~0x80;
+            frame->format_0x7.writeback_3_status &= ~0x80;
+        }
+        return;
+    }
+
+    // anything other than a debugger breakpoint / trace is reported
+    if (!gdb_trap(frame)) {
+        PRINT("Exception ", DEC(frame->vector / 4), " @ ", HEX(frame->pc), "\n");
+        cf_dump(regs);
+        profile_dump();
     }
+    gdb_stub(regs);
 }
 
 __asm__(
@@ -448,21 +1059,47 @@ __asm__(
     "   .type _fleh @function               \n"
     "   .globl _fleh                        \n"
     "_fleh:                                 \n"
-    "   movem.l %d0-%d1/%a0-%a1,%sp@-       \n" /* save caller-saved registers    */    \
-    "   move.l  %sp,%d0                     \n" /* get stack pointer              */    \
-    "   add.l   #24,%d0                     \n" /* index past saved regs          */    \
-    "   move.l  %d0,%sp@-                   \n" /* push address of hardware frame */    \
-    "   bsr     _sleh                       \n" /* _sleh(frameptr)                */    \
+    "   movem.l %d0-%d7/%a0-%a6,%sp@-       \n" /* save registers, frame follows  */    \
+    "   move.l  %sp,%sp@-                   \n" /* push address of saved regs     */    \
+    "   bsr     _sleh                       \n" /* _sleh(regs)                    */    \
     "   addq.l  #4, %sp                     \n" /* fix stack                      */    \
-    "   movem.l %sp@+,%d0-%d1/%a0-%a1       \n" /* restore caller-saved registers */    \
+    "   movem.l %sp@+,%d0-%d7/%a0-%a6       \n" /* restore registers              */    \
     "   rte                                 \n"                                         \
     );
 
+// Copy memory, returning false if an access faults.
+__asm__(
+    "   .align 2                            \n"
+    "   .type safe_copy @function           \n"
+    "   .globl safe_copy                    \n"
+    "safe_copy:                             \n"
+    "   lea     %pc@(fault_resume),%a1      \n" /* arm fault recovery             */    \
+    "   lea     %pc@(3f),%a0                \n"                                         \
+    "   move.l  %a0,%a1@                    \n"                                         \
+    "   move.l  %sp@(4),%a1                 \n" /* dst                            */    \
+    "   move.l  %sp@(8),%a0                 \n" /* src                            */    \
+    "   move.l  %sp@(12),%d0                \n" /* len                            */    \
+    "1:                                     \n"                                         \
+    "   subq.l  #1,%d0                      \n"                                         \
+    "   bcs     2f                          \n" /* ... done                       */    \
+    "   move.b  %a0@+,%a1@+                 \n"                                         \
+    "   nop                                 \n" /* synchronise any bus error      */    \
+    "   bra     1b                          \n"                                         \
+    "2:                                     \n"                                         \
+    "   lea     %pc@(fault_resume),%a1      \n" /* disarm                         */    \
+    "   clr.l   %a1@                        \n"                                         \
+    "   moveq   #1,%d0                      \n" /* return true                    */    \
+    "   rts                                 \n"                                         \
+    "3:                                     \n"                                         \
+    "   moveq   #0,%d0                      \n" /* faulted, return false          */    \
+    "   rts                                 \n"                                         \
+    );
+
 __attribute__((interrupt))
 void
 vector_unhandled(void)
 {
-    print("Unhandled interrupt");
+    PRINT("Unhandled interrupt");
     for (;;) {
         stop();
     }
@@ -480,10 +1117,16 @@ __attribute__((noreturn))
 void
 _start2(void)
 {
+    // buffers are allocated downwards from the loader
+    loader_base = (uint32_t)&_vectors;
+    arena_top = loader_base;
+
     // get the console going
     quart_init();
 
-    // enable interrupts
+    // start the timebase and enable interrupts
+    services_init();
+    timer_start(0);
     interrupt_enable(true);
 
     // run application code
@@ -491,33 +1134,26 @@ _start2(void)
 }
 
 //
-// Entry from reset vector.
+// Entry from reset vector, running from ROM or from a staged upload.
+//
+// The loader is linked at 0 and built position-independent. DRAM is
+// sized by probing each MiB above 8M, with a temporary access fault
+// handler for boards that don't decode it and an alias check for those
+// that do. The probe saves and restores everything it touches, so a
+// program left in DRAM survives for a warm re-run; a fault frame is
+// only ever stacked below DRAM_END on 8M boards, where that is loader
+// stack. The image is then copied to the top of DRAM from its two
+// parts, the bootblock and the tail at LOADER_TAIL (both found relative
+// to _reset, so this also works from the upload stage), its vectors
+// relocated, and _start entered with the end of DRAM in d4. This code
+// lives in the bootblock part.
 //
 __asm__ (
+    "   .section .text.reset,\"ax\"  \n"
     "   .align  2                   \n"
     "   .type   _reset @function    \n"
     "   .global _reset              \n"
     "_reset:                        \n" // reset entrypoint
-    "    lea     %pc@(_vectors),%a0 \n" // copy text/data to run address
-    "    lea     _vectors,%a1       \n"
-    "    lea     _edata,%a2         \n"
-    "1:                             \n"
-    "    move.l  %a0@+,%a1@+        \n"
-    "    cmp.l   %a1,%a2            \n"
-    "    bne     1b                 \n"
-    "    move.l  #_start,%a0        \n"
-    "    jmp     (%a0)              \n" // jump to _start
-    );
-
-
-//
-// Entry when uploaded, or after _reset has copied us to DRAM.
-//
-__asm__ (
-    "   .align  2                   \n"
-    "   .type   _start @function    \n"
-    "   .global _start              \n"
-    "_start:                        \n" // reset entrypoint
     "    move.w  #0x2700,%sr        \n" // interrupts off
     "    clr.l   %d0                \n"
     "    movec   %d0,%cacr          \n" // turn off caches
@@ -534,15 +1170,94 @@ __asm__ (
     "    movel   #1665,%d0          \n" // delay loop
     "1:                             \n"
     "    dbf     %d0,1b             \n"
-    "    lea     _sbss,%a0          \n" // zero bss
-    "    lea     _ebss,%a1          \n"
+    "    move.l  #0x01000000,%d0    \n" // temporary VBR at DRAM_BASE
+    "    movec   %d0,%vbr           \n"
+    "    move.l  %d0,%a0            \n"
+    "    move.l  %a0@(8),%d5        \n" // save access fault vector slot
+    "    lea     %pc@(5f),%a1       \n"
+    "    move.l  %a1,%a0@(8)        \n" // ... and point it at probe_fault
+    "    move.l  #0x01800000,%sp    \n" // DRAM_END, only used if we fault
+    "    lea     %pc@(3f),%a6       \n" // recovery address
+    "    move.l  #0x01800000,%d4    \n" // DRAM_END, always present
     "2:                             \n"
+    "    move.l  %d4,%a0            \n" // probe address
+    "    move.l  %a0,%a1            \n" // possible alias 8M below
+    "    sub.l   #0x800000,%a1      \n"
+    "    move.l  %a0@,%d1           \n" // save, faults if not decoded
+    "    move.l  %a1@,%d2           \n"
+    "    move.l  #0x5aa5c33c,%a0@   \n"
+    "    move.l  #0xa55a3cc3,%a1@   \n" // overwrites the probe if aliased
+    "    move.l  %a0@,%d3           \n"
+    "    move.l  %d1,%a0@           \n" // restore
+    "    move.l  %d2,%a1@           \n"
+    "    cmp.l   #0x5aa5c33c,%d3    \n"
+    "    bne     3f                 \n" // ... not memory, or an alias
+    "    add.l   #0x100000,%d4      \n"
+    "    cmp.l   #0x01c00000,%d4    \n" // DRAM_END_MAX
+    "    bne     2b                 \n"
+    "3:                             \n"
+    "    move.l  #0x01000000,%a0    \n" // restore the vector slot
+    "    move.l  %d5,%a0@(8)        \n"
+    "    move.l  %d4,%a1            \n" // copy text/data to the top of DRAM
+    "    sub.l   #0xc000,%a1        \n" // LOADER_SIZE
+    "    move.l  %a1,%d3            \n"
+    "    lea     %pc@(_vectors),%a0 \n"
+    "    move.l  #_eboot,%d0        \n" // bootblock part, linked at 0
+    "    lsr.l   #2,%d0             \n"
+    "    subq.l  #1,%d0             \n"
+    "4:                             \n"
+    "    move.l  %a0@+,%a1@+        \n"
+    "    dbf     %d0,4b             \n"
+    "    lea     %pc@(_vectors),%a0 \n" // then the tail
+    "    add.l   #0x1f8000,%a0      \n" // LOADER_TAIL
+    "    move.l  #_edata,%d0        \n"
+    "    sub.l   #_eboot,%d0        \n"
+    "    lsr.l   #2,%d0             \n"
+    "    subq.l  #1,%d0             \n"
+    "8:                             \n"
+    "    move.l  %a0@+,%a1@+        \n"
+    "    dbf     %d0,8b             \n"
+    "    move.l  %d3,%a0            \n" // relocate vectors 0-47
+    "    moveq   #47,%d0            \n"
+    "6:                             \n"
+    "    tst.l   %a0@               \n"
+    "    beq     7f                 \n"
+    "    add.l   %d3,%a0@           \n"
+    "7:                             \n"
+    "    addq.l  #4,%a0             \n"
+    "    dbf     %d0,6b             \n"
+    "    move.l  %d3,%a0            \n"
+    "    add.l   #_start,%a0        \n"
+    "    jmp     (%a0)              \n" // jump to _start at the copied address
+    "5:                             \n" // probe_fault
+    "    move.l  %a6,%sp@(2)        \n" // resume at the recovery address
+    "    bclr    #7,%sp@(15)        \n" // discard any pending writebacks
+    "    bclr    #7,%sp@(17)        \n"
+    "    bclr    #7,%sp@(19)        \n"
+    "    rte                        \n"
+    "   .previous                   \n"
+    );
+
+
+//
+// Entry after _reset has copied us to the top of DRAM; d4 holds the
+// end of DRAM.
+//
+__asm__ (
+    "   .align  2                   \n"
+    "   .type   _start @function    \n"
+    "   .global _start              \n"
+    "_start:                        \n"
+    "    lea     %pc@(_sbss),%a0    \n" // zero bss
+    "    lea     %pc@(_ebss),%a1    \n"
+    "1:                             \n"
     "    clr.l   %a0@+              \n"
     "    cmp.l   %a0,%a1            \n"
-    "    bne     2b                 \n"
-    "    lea     _vectors,%a0       \n"
+    "    bne     1b                 \n"
+    "    lea     %pc@(dram_end),%a0 \n"
+    "    move.l  %d4,%a0@           \n"
+    "    lea     %pc@(_vectors),%a0 \n"
     "    move.l  %a0@,%sp           \n" // read SP from vector table
     "    movec   %a0,%vbr           \n" // set VBR
-    "    move.l  #_start2,%a0       \n"
-    "    jmp     (%a0)              \n" // jump to C at the copied address
+    "    bra     _start2            \n" // jump to C
     );
@@ -8,16 +8,30 @@
 // magic numbers
 #define APP_BASE        0x00004000	// app base in flash
 #define APP_END         0x00200000	// top of flash
+#define LOADER_TAIL     0x001f8000	// rest of the loader image, top of flash
+#define LOADER_TAIL_SIZE (APP_END - LOADER_TAIL)
 #define DRAM_BASE       0x01000000	// base of DRAM
 #define DRAM_END        0x01800000	// end of DRAM (8M boards)
 #define DRAM_END_MAX    0x01c00000	// end of DRAM (12M boards)
-#define LOADER_BASE     (DRAM_END - (20 * 1024))
-#define LOADER_END      (DRAM_END)
+#define LOADER_SIZE     (48 * 1024)	// loader window, at the top of DRAM
+#define LOADER_MAGIC    0x49503934	// 'IP94' at offset 0xfc in a loader image
+#define LOADER_BOOT_LEN 0xf4		// offset of the bootblock part's length
+#define LOADER_TAIL_LEN 0xf8		// offset of the tail's length
 
 #define FLASH_SECTOR_SIZE	0x4000	// flash sector / erase size
 
+#define CF_SECTOR_SIZE  512
+#define CF_DUMP_LBA     32          // crash dump area, in the gap before
+#define CF_DUMP_SECTORS 16          // the first partition
+#define CF_BOOT_LBA     48          // boot ELF, in consecutive sectors
+
 #define TIMER_HZ		50
 
+// OX16C954 channels
+#define UART_CHANNELS   4
+#define UART_CONSOLE    0       // channel A, human console
+#define UART_DATA       1       // channel B, default data port
+
 // Registers
 #define CPLD_REV_REG	0x021000ff  // initial CPLD revision 1
 #define EXPANSION_BASE	0x02130000  // base address for expansion decode
@@ -25,22 +39,340 @@
 // symbols from the linker script
 extern uint32_t	_sdata, _edata, _sbss, _ebss, _vectors;
 
+// registers saved by _fleh, followed by the exception frame
+typedef struct {
+    uint32_t d[8];
+    uint32_t a[7];
+} regs_t;
+
+typedef struct __attribute__((packed)) {
+    uint16_t sr;
+    uint32_t pc;
+    uint16_t format:4;
+    uint16_t vector:12;
+    union {
+        struct {
+            uint32_t address;
+        } format_0x2;
+        struct {
+            uint32_t effective_address;
+        } format_0x3;
+        struct {
+            uint32_t effective_address;
+            uint32_t faulting_pc;
+        } format_0x4;
+        struct {
+            uint32_t effective_address;
+            uint16_t ssw;
+            uint16_t writeback_3_status;
+            uint16_t writeback_2_status;
+            uint16_t writeback_1_status;
+            uint32_t fault_address;
+            uint32_t writeback_3_address;
+            uint32_t writeback_3_data;
+            uint32_t writeback_2_address;
+            uint32_t writeback_2_data;
+            uint32_t writeback_1_address;
+            uint32_t writeback_1_data;
+            uint32_t push_data_1;
+            uint32_t push_data_2;
+            uint32_t push_data_3;
+        } format_0x7;
+        struct {
+            uint16_t ssw;
+            uint32_t fault_address;
+            uint16_t :16;
+            uint16_t output_buffer;
+            uint16_t :16;
+            uint16_t input_buffer;
+            uint16_t :16;
+            uint16_t instruction_buffer;
+            uint16_t internal[16];
+        } format_0x8;
+        struct {
+            uint32_t instruction_address;
+            uint16_t internal[4];
+        } format_0x9;
+        struct {
+            uint16_t internal_0;
+            uint16_t ssw;
+            uint16_t instruction_pipe_c;
+            uint16_t instruction_pipe_b;
+            uint32_t data_fault_address;
+            uint16_t internal_1;
+            uint16_t internal_2;
+            uint32_t data_output_buffer;
+            uint16_t internal_3;
+            uint16_t internal_4;
+        } format_0xa;
+        struct {
+            uint16_t internal_0;
+            uint16_t ssw;
+            uint16_t instruction_pipe_c;
+            uint16_t instruction_pipe_b;
+            uint32_t data_fault_address;
+            uint16_t internal_1;
+            uint16_t internal_2;
+            uint32_t data_output_buffer;
+            uint16_t internal_3[4];
+            uint32_t stage_b_address;
+            uint16_t internal_4[2];
+            uint32_t data_input_buffer;
+            uint16_t internal_5[3];
+            uint16_t version:4;
+            uint16_t internal_6:12;
+            uint16_t internal_7[18];
+        } format_0xb;
+        struct {
+            uint32_t faulted_address;
+            uint32_t data_buffer;
+            uint32_t current_pc;
+            uint16_t internal_xfer_count;
+            uint16_t subformat:2;
+            uint16_t ssw:14;
+        } format_0xc;
+    };
+} frame_t;
+
+// a program loaded into DRAM
+typedef struct {
+    uint32_t entry;
+    uint32_t text_base;         // code, for profiling
+    uint32_t text_limit;
+    uint32_t load_base;         // loaded data, checked for warm re-run
+    uint32_t load_limit;
+    uint32_t bss_base;          // zeroed for warm re-run
+    uint32_t bss_limit;
+} image_t;
+
+// Cooperative tasks.
+//
+// A task is a protothread: the scheduler calls its function over and
+// over, and it resumes at the TASK_WAIT_UNTIL() or TASK_YIELD() where it
+// last returned. Locals do not survive a wait, so task state lives in
+// statics, and only the task function itself may wait. When no task
+// has yielded in a pass the CPU is idled until the next interrupt.
+#define TASKS_MAX           8
+
+enum {
+    TASK_WAITING,                   // blocked on a condition
+    TASK_YIELDED,                   // made progress, run again soon
+    TASK_EXITED,
+};
+
+typedef struct task {
+    uint16_t    lc;                 // resume point, 0 to start
+    uint8_t     (*run)(struct task *task);
+} task_t;
+
+#define TASK_BEGIN(_t)              switch ((_t)->lc) { case 0:
+#define TASK_END(_t)                } (_t)->lc = 0; return TASK_EXITED
+#define TASK_EXIT(_t)               do { (_t)->lc = 0; return TASK_EXITED; } while (0)
+#define TASK_WAIT_UNTIL(_t, _cond)  do { (_t)->lc = __LINE__; case __LINE__:     \
+                                         if (!(_cond)) { return TASK_WAITING; } \
+                                    } while (0)
+#define TASK_YIELD(_t)              do { (_t)->lc = __LINE__; return TASK_YIELDED; \
+                                         case __LINE__:;                        \
+                                    } while (0)
+
+// Incremental flash sector erase / program, see flash_job_step().
+enum {
+    FLASH_BUSY,
+    FLASH_DONE,
+    FLASH_FAILED,
+};
+
+typedef struct {
+    volatile uint32_t   *addr;
+    const uint32_t      *buf;       // NULL to erase only
+    uint32_t            offset;     // next word to program
+    uint32_t            polls;      // erase polls remaining
+    uint8_t             state;
+} flash_job_t;
+
+// DRAM self test modes
+enum {
+    POST_SKIP,
+    POST_QUICK,                 // MATS+
+    POST_FULL,                  // March C-
+};
+
+// a range of bus addresses that responded to the probe
+#define PROBE_REGIONS_MAX   16
+
+typedef struct {
+    uint32_t    base;
+    uint32_t    limit;
+    uint32_t    access_ns;      // byte read, loop overhead removed
+    char        name[8];
+} probe_region_t;
+
+// Loader services, published for loaded programs. TRAP #0 returns
+// the table in a0 and its version in d0; the loader moves with the
+// size of DRAM, so that is the only way to find it. Entries use the C
+// calling convention and are only ever appended; offsets are mirrored
+// in defs.h.
+#define SERVICES_MAGIC      0x49505356      // 'IPSV'
+#define SERVICES_VERSION    3
+
+typedef struct {
+    uint32_t    magic;
+    uint16_t    version;
+    uint16_t    size;
+    // console and UARTs
+    void        (*putc)(char c);
+    void        (*puts)(const char *s);
+    int         (*getc)(void);
+    bool        (*waitc)(uint32_t ticks);
+    void        (*uart_write)(uint32_t ch, const void *buf, uint32_t len);
+    bool        (*uart_ready)(uint32_t ch);
+    int         (*uart_getc)(uint32_t ch);
+    void        (*uart_read)(uint32_t ch, void *buf, uint32_t len);
+    void        (*uart_flush)(uint32_t ch);
+    // timer
+    uint32_t    (*uptime)(void);
+    void        (*timer_start)(uint32_t ticks);
+    void        (*timer_stop)(void);
+    // CF
+    uint32_t    (*cf_size)(void);
+    bool        (*cf_read)(uint32_t lba, void *buf, uint32_t count);
+    bool        (*cf_write)(uint32_t lba, const void *buf, uint32_t count);
+    bool        (*cf_flush)(void);
+    // flash
+    bool        (*flash_erase)(uint32_t addr);
+    bool        (*flash_program)(volatile uint32_t *addr, uint32_t *buf);
+    // misc
+    uint32_t    (*crc32)(uint32_t crc, const void *buf, uint32_t len);
+    // version 2
+    uint32_t    (*arena_limit)(void);       // top of DRAM free for programs
+    // version 3
+    uint32_t    (*probe_map)(const probe_region_t **map);
+} services_t;
+
 // functions
 __attribute__((noreturn)) extern void main(void);
 extern void lib_init();
+extern uint32_t dram_end;
+extern uint32_t loader_base;
+extern void *arena_alloc(uint32_t size);
+extern uint32_t arena_limit(void);
 extern void putc(char c);
 extern void puts(const char *s);
+extern void putraw(const void *buf, uint32_t len);
 extern int getc(void);
+extern void getraw(void *buf, uint32_t len);
 extern bool waitc(uint32_t ticks);
-extern bool askyn(uint32_t ticks);
-extern uint32_t getx8(void);
-extern uint32_t getx32(void);
-extern void print(const char *fmt, ...);
+extern uint32_t getx8(uint32_t ch);
+extern uint32_t getx32(uint32_t ch);
+extern uint32_t data_port;
+extern void uart_init(uint32_t ch, uint32_t rate);
+extern void uart_poll(void);
+extern void uart_write(uint32_t ch, const void *buf, uint32_t len);
+extern void uart_flush(uint32_t ch);
+extern bool uart_ready(uint32_t ch);
+extern int uart_getc(uint32_t ch);
+extern void uart_read(uint32_t ch, void *buf, uint32_t len);
+extern bool uart_wait(uint32_t ch, uint32_t ticks);
 extern void timer_start(uint32_t ticks);
 extern void timer_stop(void);
+extern uint32_t timer_uptime(void);
 extern volatile uint32_t timer_count;
+extern bool timer_ticking(void);
+extern void cpu_idle(void);
+extern void task_add(task_t *task, uint8_t (*run)(task_t *task));
+extern bool task_active(const task_t *task);
+__attribute__((noreturn)) extern void task_run(void);
 extern bool flash_check_rom_id(void);
+extern void flash_job_start(flash_job_t *job, volatile uint32_t *addr, const uint32_t *buf);
+extern uint32_t flash_job_step(flash_job_t *job);
 extern bool flash_program_page(volatile uint32_t *addr, uint32_t *buf);
+extern uint32_t crc32(uint32_t crc, const void *buf, uint32_t len);
+extern bool profile_armed;
+extern bool profile_start(uint32_t base, uint32_t limit, uint32_t image_limit);
+extern void profile_dump(void);
+extern void call_program(uint32_t entrypoint);
+extern void run_program(const image_t *image);
+extern bool elf_load(void (*read)(void *buf, uint32_t len), image_t *image);
+extern uint32_t warm_reset_count(void);
+extern bool warm_image(image_t *image);
+extern bool warm_recorded(void);
+extern uint32_t cf_sectors;
+extern char cf_model[];
+extern void cf_start(void);
+extern bool cf_done(void);
+extern bool cf_read(uint32_t lba, void *buf, uint32_t count);
+extern bool cf_write(uint32_t lba, const void *buf, uint32_t count);
+extern bool cf_flush(void);
+extern void cf_stream_start(uint32_t lba);
+extern void cf_stream_read(void *buf, uint32_t len);
+extern bool cf_stream_ok(void);
+extern void cf_dump(const regs_t *regs);
+extern void services_init(void);
+extern void probe_start(void);
+extern bool probe_done(void);
+extern uint32_t probe_map(const probe_region_t **map);
+extern void post_start(uint32_t mode);
+extern bool post_done(void);
+extern bool post_passed(void);
+extern void post_run(uint32_t mode);
+extern uint32_t frame_size(const frame_t *frame);
+extern bool safe_copy(void *dst, const void *src, uint32_t len);
+extern bool gdb_trap(const frame_t *frame);
+extern void gdb_stub(regs_t *regs);
+extern bool monitor_key(char c);
+extern void monitor_prompt(void);
+
+// Formatted console output.
+//
+// PRINT() takes a list of string and typed-value arguments, resolved
+// at compile time into a sequence of emitter calls; e.g.
+//
+//     PRINT("++ load ", HEX(base), " (", DEC(len), " bytes)\n");
+//
+// The line is assembled in a buffer and queued for the console in one
+// write. Arguments without a wrapper must be strings.
+typedef struct { uint32_t v; } fmt_dec_t;
+typedef struct { uint32_t v; } fmt_hex_t;
+typedef struct { uint8_t v; } fmt_hex8_t;
+
+#define DEC(_x)         ((fmt_dec_t){ (uint32_t)(_x) })
+#define HEX(_x)         ((fmt_hex_t){ (uint32_t)(_x) })
+#define HEX8(_x)        ((fmt_hex8_t){ (uint8_t)(_x) })
+
+extern void fmt_begin(void);
+extern void fmt_end(void);
+extern void fmt_str(const char *s);
+extern void fmt_dec(fmt_dec_t x);
+extern void fmt_hex(fmt_hex_t x);
+extern void fmt_hex8(fmt_hex8_t x);
+
+#define _FMT(_x)        _Generic((_x),                  \
+                                 fmt_dec_t: fmt_dec,    \
+                                 fmt_hex_t: fmt_hex,    \
+                                 fmt_hex8_t: fmt_hex8,  \
+                                 char *: fmt_str,       \
+                                 const char *: fmt_str)(_x);
+#define _FMT1(_a)       _FMT(_a)
+#define _FMT2(_a, ...)  _FMT(_a) _FMT1(__VA_ARGS__)
+#define _FMT3(_a, ...)  _FMT(_a) _FMT2(__VA_ARGS__)
+#define _FMT4(_a, ...)  _FMT(_a) _FMT3(__VA_ARGS__)
+#define _FMT5(_a, ...)  _FMT(_a) _FMT4(__VA_ARGS__)
+#define _FMT6(_a, ...)  _FMT(_a) _FMT5(__VA_ARGS__)
+#define _FMT7(_a, ...)  _FMT(_a) _FMT6(__VA_ARGS__)
+#define _FMT8(_a, ...)  _FMT(_a) _FMT7(__VA_ARGS__)
+#define _FMT9(_a, ...)  _FMT(_a) _FMT8(__VA_ARGS__)
+#define _FMT10(_a, ...) _FMT(_a) _FMT9(__VA_ARGS__)
+#define _FMT11(_a, ...) _FMT(_a) _FMT10(__VA_ARGS__)
+#define _FMT12(_a, ...) _FMT(_a) _FMT11(__VA_ARGS__)
+#define _FMT_SELECT(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _n, ...) _n
+#define PRINT(...)                                                          \
+    do {                                                                    \
+        fmt_begin();                                                        \
+        _FMT_SELECT(__VA_ARGS__, _FMT12, _FMT11, _FMT10, _FMT9, _FMT8,      \
+                    _FMT7, _FMT6, _FMT5, _FMT4, _FMT3, _FMT2, _FMT1)        \
+            (__VA_ARGS__)                                                   \
+        fmt_end();                                                          \
+    } while (0)
 
 static inline void
 set_vbr(const void *vector_base) {
@@ -0,0 +1,406 @@
+/*
+ * Resident monitor for the IP940 loader.
+ *
+ * Commands are typed at the S-record prompt; numbers are hex.
+ *
+ *  pb|pw|pl <addr> [<value>]   peek / poke byte, word, long
+ *  d <addr> [<len>]            hex dump
+ *  f <addr> <len> <byte>       fill
+ *  c <src> <dst> <len>         copy
+ *  cmp <addr1> <addr2> <len>   compare
+ *  br <addr> <len>             binary read, raw data + CRC32
+ *  bw <addr> <len>             binary write, raw data + CRC32
+ *  port [<channel>]            select the UART channel for binary data
+ *  probe                       re-probe and print the bus map
+ *  post [1]                    DRAM test, March C- or MATS+ (quick)
+ *  cfr <lba> <addr> <count>    read CF sectors to memory
+ *  cfw <addr> <lba> <count>    write memory to CF sectors
+ *  g <addr>                    call program at address
+ *  gdb                         enter the GDB stub
+ *  elf                         load and run a binary ELF executable
+ *  profile                     toggle profiling of the next program run
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "ip940_lib.h"
+
+#define LINE_MAX        80
+#define DUMP_DEFAULT    0x100
+
+static char line[LINE_MAX];
+static uint32_t line_len;
+
+static bool
+streq(const char *a, const char *b)
+{
+    while (*a && (*a == *b)) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+// split the line into space-separated words in place
+static uint32_t
+split(char **argv, uint32_t max)
+{
+    uint32_t argc = 0;
+    char *p = line;
+
+    for (;;) {
+        while (*p == ' ') {
+            *p++ = '\0';
+        }
+        if ((*p == '\0') || (argc == max)) {
+            return argc;
+        }
+        argv[argc++] = p;
+        while (*p && (*p != ' ')) {
+            p++;
+        }
+    }
+}
+
+static bool
+parse_hex(const char *s, uint32_t *value)
+{
+    uint32_t v = 0;
+
+    if ((s[0] == '0') && ((s[1] == 'x') || (s[1] == 'X'))) {
+        s += 2;
+    }
+    if (*s == '\0') {
+        return false;
+    }
+    while (*s) {
+        const char c = *s++;
+        switch (c) {
+        case '0'...'9':
+            v = (v << 4) | (c - '0');
+            break;
+        case 'a' ... 'f':
+            v = (v << 4) | (c - 'a' + 10);
+            break;
+        case 'A' ... 'F':
+            v = (v << 4) | (c - 'A' + 10);
+            break;
+        default:
+            return false;
+        }
+    }
+    *value = v;
+    return true;
+}
+
+// parse argv[1..argc-1] into args[], all must be valid hex
+static bool
+parse_args(uint32_t argc, char **argv, uint32_t *args)
+{
+    for (uint32_t i = 1; i < argc; i++) {
+        if (!parse_hex(argv[i], &args[i - 1])) {
+            PRINT("!! bad number '", argv[i], "'\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+static void
+cmd_peek_poke(char width, uint32_t argc, const uint32_t *args)
+{
+    const uint32_t addr = args[0];
+
+    switch (width) {
+    case 'b':
+        if (argc == 3) {
+            *(volatile uint8_t *)addr = args[1];
+        }
+        PRINT(HEX(addr), ": ", HEX8(*(volatile uint8_t *)addr), "\n");
+        break;
+    case 'w':
+        if (argc == 3) {
+            *(volatile uint16_t *)addr = args[1];
+        }
+        PRINT(HEX(addr), ": ", HEX(*(volatile uint16_t *)addr), "\n");
+        break;
+    case 'l':
+        if (argc == 3) {
+            *(volatile uint32_t *)addr = args[1];
+        }
+        PRINT(HEX(addr), ": ", HEX(*(volatile uint32_t *)addr), "\n");
+        break;
+    }
+}
+
+static void
+cmd_dump(uint32_t addr, uint32_t len)
+{
+    static const char xtab[] = "0123456789abcdef";
+
+    while (len > 0) {
+        const uint8_t *p = (const uint8_t *)addr;
+        const uint32_t n = (len < 16) ? len : 16;
+        char hex[16 * 3 + 1];
+        char ascii[16 + 1];
+
+        for (uint32_t i = 0; i < 16; i++) {
+            if (i < n) {
+                const uint8_t b = p[i];
+                hex[i * 3] = xtab[b >> 4];
+                hex[i * 3 + 1] = xtab[b & 0xf];
+                ascii[i] = ((b >= ' ') && (b < 0x7f)) ? b : '.';
+            } else {
+                hex[i * 3] = ' ';
+                hex[i * 3 + 1] = ' ';
+                ascii[i] = ' ';
+            }
+            hex[i * 3 + 2] = ' ';
+        }
+        hex[16 * 3] = '\0';
+        ascii[16] = '\0';
+        PRINT(HEX(addr), ": ", hex, " ", ascii, "\n");
+        addr += n;
+        len -= n;
+    }
+}
+
+static void
+cmd_fill(uint8_t *dst, uint32_t len, uint8_t value)
+{
+    while (len--) {
+        *dst++ = value;
+    }
+}
+
+static void
+cmd_copy(const uint8_t *src, uint8_t *dst, uint32_t len)
+{
+    if (dst < src) {
+        while (len--) {
+            *dst++ = *src++;
+        }
+    } else {
+        src += len;
+        dst += len;
+        while (len--) {
+            *--dst = *--src;
+        }
+    }
+}
+
+static void
+cmd_compare(const uint8_t *a, const uint8_t *b, uint32_t len)
+{
+    uint32_t differences = 0;
+
+    for (uint32_t i = 0; i < len; i++) {
+        if (a[i] != b[i]) {
+            if (differences == 0) {
+                PRINT("++ first difference ", HEX(a + i), ": ", HEX8(a[i]),
+                      " / ", HEX(b + i), ": ", HEX8(b[i]), "\n");
+            }
+            differences++;
+        }
+    }
+    PRINT("++ ", DEC(differences), " bytes differ\n");
+}
+
+// Binary read: the host waits for the "++ br" line, then receives
+// exactly <len> raw bytes followed by the big-endian CRC32.
+static void
+cmd_binary_read(const uint8_t *src, uint32_t len)
+{
+    uint8_t trailer[4];
+    uint32_t crc = 0;
+
+    PRINT("++ br ", DEC(len), "\n");
+    while (len > 0) {
+        const uint32_t n = (len < 512) ? len : 512;
+        crc = crc32(crc, src, n);
+        putraw(src, n);
+        src += n;
+        len -= n;
+    }
+    trailer[0] = crc >> 24;
+    trailer[1] = crc >> 16;
+    trailer[2] = crc >> 8;
+    trailer[3] = crc;
+    putraw(trailer, sizeof(trailer));
+}
+
+// Binary write: the host waits for the "++ bw" line, then sends
+// exactly <len> raw bytes followed by the big-endian CRC32.
+static void
+cmd_binary_write(uint8_t *dst, uint32_t len)
+{
+    uint8_t trailer[4];
+
+    PRINT("++ bw ", DEC(len), "\n");
+    getraw(dst, len);
+    getraw(trailer, sizeof(trailer));
+    const uint32_t expected = ((uint32_t)trailer[0] << 24) |
+                              ((uint32_t)trailer[1] << 16) |
+                              ((uint32_t)trailer[2] << 8) |
+                              trailer[3];
+    const uint32_t crc = crc32(0, dst, len);
+    if (crc != expected) {
+        PRINT("!! CRC mismatch (", HEX(crc), " expected ", HEX(expected), ")\n");
+        return;
+    }
+    PRINT("++ OK\n");
+}
+
+static void
+cmd_elf(void)
+{
+    image_t image;
+
+    PRINT("++ ready for ELF\n");
+    const bool loaded = elf_load(getraw, &image);
+
+    // discard the rest of the file (section headers, symbols, etc.)
+    while (uart_wait(data_port, TIMER_HZ / 10)) {
+    }
+    if (loaded) {
+        run_program(&image);
+    }
+}
+
+static void
+cmd_cf(bool write, uint32_t lba, uint8_t *addr, uint32_t count)
+{
+    if (cf_sectors == 0) {
+        PRINT("!! no CF card\n");
+        return;
+    }
+    const bool ok = write ? (cf_write(lba, addr, count) && cf_flush()) : cf_read(lba, addr, count);
+    if (!ok) {
+        PRINT("!! CF ", write ? "write" : "read", " failed\n");
+        return;
+    }
+    PRINT("++ OK\n");
+}
+
+// Select the channel used for binary transfers; channels other than
+// the console run at 921600.
+static void
+cmd_port(uint32_t argc, const uint32_t *args)
+{
+    if (argc == 2) {
+        if (args[0] >= UART_CHANNELS) {
+            PRINT("!! no channel ", DEC(args[0]), "\n");
+            return;
+        }
+        data_port = args[0];
+        if (data_port != UART_CONSOLE) {
+            uart_init(data_port, 921600);
+        }
+    }
+    PRINT("++ data port ", DEC(data_port),
+          " (", (data_port == UART_CONSOLE) ? "console" : "921600", ")\n");
+}
+
+static void
+monitor_command(void)
+{
+    char *argv[4];
+    uint32_t args[3];
+    const uint32_t argc = split(argv, 4);
+
+    if (argc == 0) {
+        return;
+    }
+    if (!parse_args(argc, argv, args)) {
+        return;
+    }
+    const char *cmd = argv[0];
+
+    if ((streq(cmd, "pb") || streq(cmd, "pw") || streq(cmd, "pl")) &&
+        ((argc == 2) || (argc == 3))) {
+        cmd_peek_poke(cmd[1], argc, args);
+    } else if (streq(cmd, "d") && ((argc == 2) || (argc == 3))) {
+        cmd_dump(args[0], (argc == 3) ? args[1] : DUMP_DEFAULT);
+    } else if (streq(cmd, "f") && (argc == 4)) {
+        cmd_fill((uint8_t *)args[0], args[1], args[2]);
+    } else if (streq(cmd, "c") && (argc == 4)) {
+        cmd_copy((const uint8_t *)args[0], (uint8_t *)args[1], args[2]);
+    } else if (streq(cmd, "cmp") && (argc == 4)) {
+        cmd_compare((const uint8_t *)args[0], (const uint8_t *)args[1], args[2]);
+    } else if (streq(cmd, "br") && (argc == 3)) {
+        cmd_binary_read((const uint8_t *)args[0], args[1]);
+    } else if (streq(cmd, "bw") && (argc == 3)) {
+        cmd_binary_write((uint8_t *)args[0], args[1]);
+    } else if (streq(cmd, "cfr") && (argc == 4)) {
+        cmd_cf(false, args[0], (uint8_t *)args[1], args[2]);
+    } else if (streq(cmd, "cfw") && (argc == 4)) {
+        cmd_cf(true, args[1], (uint8_t *)args[0], args[2]);
+    } else if (streq(cmd, "port") && (argc <= 2)) {
+        cmd_port(argc, args);
+    } else if (streq(cmd, "probe") && (argc == 1)) {
+        if (!probe_done()) {
+            PRINT("!! probe in progress\n");
+        } else {
+            probe_start();
+        }
+    } else if (streq(cmd, "post") && (argc <= 2)) {
+        if (!post_done()) {
+            PRINT("!! DRAM test in progress\n");
+        } else {
+            post_run(((argc == 2) && args[0]) ? POST_QUICK : POST_FULL);
+        }
+    } else if (streq(cmd, "g") && (argc == 2)) {
+        uart_flush(UART_CONSOLE);
+        call_program(args[0]);
+    } else if (streq(cmd, "elf") && (argc == 1)) {
+        cmd_elf();
+    } else if (streq(cmd, "gdb") && (argc == 1)) {
+        PRINT("++ entering GDB stub\n");
+        __asm__ volatile ("trap #15" : : : "memory");
+    } else if (streq(cmd, "profile") && (argc == 1)) {
+        profile_armed = !profile_armed;
+        PRINT("++ profiler ", profile_armed ? "armed" : "off", "\n");
+    } else {
+        PRINT("!! commands: pb pw pl d f c cmp br bw cfr cfw port probe post g elf gdb profile\n");
+    }
+}
+
+void
+monitor_prompt(void)
+{
+    PRINT("> ");
+}
+
+// Feed a character from the console to the monitor; returns true if
+// it starts an S-record instead.
+bool
+monitor_key(char c)
+{
+    switch (c) {
+    case 'S':
+        if (line_len == 0) {
+            return true;
+        }
+        break;
+    case '\r':
+    case '\n':
+        putc('\n');
+        line[line_len] = '\0';
+        line_len = 0;
+        monitor_command();
+        monitor_prompt();
+        return false;
+    case '\b':
+    case 0x7f:
+        if (line_len > 0) {
+            line_len--;
+            PRINT("\b \b");
+        }
+        return false;
+    }
+    if ((c >= ' ') && (line_len < (LINE_MAX - 1))) {
+        line[line_len++] = c;
+        putc(c);
+    }
+    return false;
+}
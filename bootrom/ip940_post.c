@@ -0,0 +1,288 @@
+/*
+ * DRAM power-on self test for IP940.
+ *
+ * March tests over the DRAM below the loader's arena, a 16-byte line
+ * at a time. Each line is read through the data cache, so the first
+ * read misses and fills the line with a burst, and written with MOVE16,
+ * which bursts an aligned pattern line out and invalidates any cached
+ * copy so that the next element reads DRAM again. While a chunk is
+ * tested, DRAM is transparently mapped write-through and the I/O space
+ * non-cachable; the caches are off again between chunks, so the rest
+ * of the loader always sees them off.
+ *
+ * The full test is March C-, the quick one MATS+. Both destroy the
+ * contents of the range, so a warm reset that may re-run the last
+ * program skips the test.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "ip940_lib.h"
+
+#define POST_CHUNK      0x10000         // bytes per step
+#define POST_LINE       16
+
+#define CACR_DE         0x80000000
+#define CACR_IE         0x00008000
+#define TTR_DRAM        0x0100c000      // 0x01xxxxxx, write-through
+#define TTR_IO          0x0201c040      // 0x02xxxxxx-0x03xxxxxx, non-cachable serialized
+
+enum {
+    P_NONE,
+    P_0,
+    P_1,
+};
+
+typedef struct {
+    uint8_t     down;
+    uint8_t     read;                   // expected background
+    uint8_t     write;                  // background written
+} post_element_t;
+
+static const post_element_t march_c[] = {
+    { false, P_NONE, P_0 },
+    { false, P_0, P_1 },
+    { false, P_1, P_0 },
+    { true, P_0, P_1 },
+    { true, P_1, P_0 },
+    { false, P_0, P_NONE },
+};
+
+static const post_element_t mats_plus[] = {
+    { false, P_NONE, P_0 },
+    { false, P_0, P_1 },
+    { true, P_1, P_0 },
+};
+
+static uint32_t post_line[POST_LINE / 4] __attribute__((aligned(16)));
+
+static task_t post_task;
+static uint32_t post_mode;
+static const post_element_t *post_elements;
+static uint32_t post_count;
+static uint32_t post_element;
+static uint32_t post_addr;              // next line, or the one above it going down
+static uint32_t post_base;
+static uint32_t post_limit;
+static uint32_t post_start_tick;
+static uint32_t post_write_bw;          // bytes per tick
+static uint32_t post_read_bw;
+static bool post_failed;
+static uint32_t post_fail_addr;
+static uint32_t post_fail_expected;
+static uint32_t post_fail_actual;
+
+static void
+cache_on(void)
+{
+    __asm__ volatile (
+        "   cinva   %%bc            \n"
+        "   movec   %0,%%dtt0       \n"
+        "   movec   %1,%%dtt1       \n"
+        "   movec   %0,%%itt0       \n"
+        "   movec   %2,%%cacr       \n"
+        :
+        : "d" (TTR_DRAM), "d" (TTR_IO), "d" (CACR_DE | CACR_IE)
+        : "memory"
+    );
+}
+
+// DRAM is write-through, so there is nothing to push.
+static void
+cache_off(void)
+{
+    __asm__ volatile (
+        "   movec   %0,%%cacr       \n"
+        "   cinva   %%bc            \n"
+        "   movec   %0,%%dtt0       \n"
+        "   movec   %0,%%dtt1       \n"
+        "   movec   %0,%%itt0       \n"
+        :
+        : "d" (0)
+        : "memory"
+    );
+}
+
+static inline void
+move16(const void *src, void *dst)
+{
+    __asm__ volatile (
+        "   move16  %0@+,%1@+       \n"
+        : "+a" (src), "+a" (dst)
+        :
+        : "memory"
+    );
+}
+
+static uint32_t
+post_background(uint8_t p)
+{
+    return (p == P_1) ? 0xffffffff : 0;
+}
+
+// Bytes moved in one timer tick by MOVE16 writes or line-filling
+// reads over the first chunk.
+static uint32_t
+post_bandwidth(bool write)
+{
+    uint32_t bytes = 0;
+    uint32_t t = timer_uptime();
+
+    while (timer_uptime() == t) {
+        cpu_idle();
+    }
+    t = timer_uptime();
+    cache_on();
+    while (timer_uptime() == t) {
+        for (uint32_t addr = post_base; addr < (post_base + POST_CHUNK); addr += POST_LINE) {
+            if (write) {
+                move16(post_line, (void *)addr);
+            } else {
+                const volatile uint32_t *p = (const volatile uint32_t *)addr;
+                (void)p[0];
+                (void)p[1];
+                (void)p[2];
+                (void)p[3];
+            }
+        }
+        bytes += POST_CHUNK;
+    }
+    cache_off();
+    return bytes;
+}
+
+static void
+post_reset(void)
+{
+    post_elements = (post_mode == POST_FULL) ? march_c : mats_plus;
+    post_count = (post_mode == POST_FULL) ?
+                 (sizeof(march_c) / sizeof(march_c[0])) :
+                 (sizeof(mats_plus) / sizeof(mats_plus[0]));
+    post_element = 0;
+    post_base = DRAM_BASE;
+    post_limit = arena_limit() & ~(POST_LINE - 1);
+    post_addr = post_elements[0].down ? post_limit : post_base;
+    post_failed = false;
+    post_write_bw = post_bandwidth(true);
+    post_read_bw = post_bandwidth(false);
+    post_start_tick = timer_uptime();
+}
+
+// Run the current element over the next chunk; returns false once
+// every element has been run or a line has failed.
+static bool
+post_step(void)
+{
+    if (post_failed || (post_element == post_count)) {
+        return false;
+    }
+    const post_element_t *e = &post_elements[post_element];
+    const uint32_t expected = post_background(e->read);
+    const uint32_t value = post_background(e->write);
+
+    for (uint32_t i = 0; i < (POST_LINE / 4); i++) {
+        post_line[i] = value;
+    }
+    cache_on();
+    for (uint32_t n = 0; n < (POST_CHUNK / POST_LINE); n++) {
+        if (e->down ? (post_addr == post_base) : (post_addr == post_limit)) {
+            break;
+        }
+        const uint32_t addr = e->down ? (post_addr - POST_LINE) : post_addr;
+        if (e->read != P_NONE) {
+            const volatile uint32_t *p = (const volatile uint32_t *)addr;
+            for (uint32_t i = 0; i < (POST_LINE / 4); i++) {
+                const uint32_t actual = p[i];
+                if (actual != expected) {
+                    post_failed = true;
+                    post_fail_addr = addr + i * 4;
+                    post_fail_expected = expected;
+                    post_fail_actual = actual;
+                    break;
+                }
+            }
+            if (post_failed) {
+                break;
+            }
+        }
+        if (e->write != P_NONE) {
+            move16(post_line, (void *)addr);
+        }
+        post_addr = addr + (e->down ? 0 : POST_LINE);
+    }
+    cache_off();
+
+    // next element starts from its own end of the range
+    if (e->down ? (post_addr == post_base) : (post_addr == post_limit)) {
+        if (++post_element < post_count) {
+            post_addr = post_elements[post_element].down ? post_limit : post_base;
+        }
+    }
+    return true;
+}
+
+static void
+post_report(void)
+{
+    const char *name = (post_mode == POST_FULL) ? "March C-" : "MATS+";
+
+    if (post_failed) {
+        PRINT("!! DRAM test : ", name, " failed at ", HEX(post_fail_addr),
+              ", expected ", HEX(post_fail_expected), " read ", HEX(post_fail_actual), "\n");
+        return;
+    }
+    PRINT("** DRAM test : ", name, " passed, ", HEX(post_base), "...", HEX(post_limit - 1),
+          " in ", DEC((timer_uptime() - post_start_tick) * (1000 / TIMER_HZ)), "ms\n");
+    PRINT("**             MOVE16 write ", DEC((post_write_bw * TIMER_HZ) >> 20),
+          "MiB/s, burst read ", DEC((post_read_bw * TIMER_HZ) >> 20), "MiB/s\n");
+}
+
+// A chunk per pass, so the test overlaps with the bus probe and the
+// boot source checks.
+static uint8_t
+post_task_run(task_t *t)
+{
+    TASK_BEGIN(t);
+    post_reset();
+    while (post_step()) {
+        TASK_YIELD(t);
+    }
+    post_report();
+    TASK_END(t);
+}
+
+// Test DRAM in the background; POST_SKIP only says so.
+void
+post_start(uint32_t mode)
+{
+    post_failed = false;
+    if (mode == POST_SKIP) {
+        PRINT("** DRAM test : skipped\n");
+        return;
+    }
+    post_mode = mode;
+    task_add(&post_task, post_task_run);
+}
+
+bool
+post_done(void)
+{
+    return !task_active(&post_task);
+}
+
+bool
+post_passed(void)
+{
+    return post_done() && !post_failed;
+}
+
+// Test DRAM now, for the monitor; destroys everything below the arena.
+void
+post_run(uint32_t mode)
+{
+    post_mode = mode;
+    post_reset();
+    while (post_step()) {
+    }
+    post_report();
+}
@@ -0,0 +1,194 @@
+/*
+ * Bus probe for IP940.
+ *
+ * Walks the ROM, expansion and baseboard I/O spaces one window at a
+ * time, reading a single byte from each with access faults caught by
+ * safe_copy(). Consecutive windows that respond are merged into a
+ * region, and the first window of each region is timed against the
+ * 50Hz tick to estimate the cost of an access. The map is printed at
+ * startup and published in the services table.
+ *
+ * Addresses are chosen to avoid side effects; in particular any access
+ * to the CPLD timer registers stops or starts the timers, so the CPLD
+ * window is probed at the revision register. The KS84C31 configuration
+ * space at 0x04000000 is never touched.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "ip940_lib.h"
+
+#define PROBE_UNROLL        4       // accesses per timing loop
+
+static const struct {
+    uint32_t    base;
+    uint32_t    limit;
+    uint32_t    step;               // window size
+    uint32_t    offset;             // address probed in each window
+    char        name[8];
+} probe_spaces[] = {
+    { 0x00000000,   0x00800000, 0x00100000, 0x00,   "ROM"    },
+    { 0x00800000,   0x01000000, 0x00100000, 0x00,   "BUSCE0" },  // 0x008x / 0x00cx
+    { 0x02000000,   0x02100000, 0x00010000, 0x00,   "IO"     },
+    { 0x02100000,   0x02110000, 0x00010000, 0xff,   "CPLD"   },  // CPLD_REV_REG
+    { 0x02110000,   0x02120000, 0x00010000, 0x1f,   "QUART"  },  // channel A SPR
+    { 0x02120000,   EXPANSION_BASE, 0x00010000, 0x00, "IO"   },
+    { EXPANSION_BASE, 0x02200000, 0x00010000, 0x00, "EXP"    },
+    { 0x02200000,   0x03000000, 0x00100000, 0x00,   "BUSCE0" },  // 0x02xx
+};
+
+static probe_region_t probe_regions[PROBE_REGIONS_MAX];
+static uint32_t probe_count;
+
+static bool
+probe_responds(uint32_t addr)
+{
+    uint8_t discard;
+    return safe_copy(&discard, (const void *)addr, 1);
+}
+
+// Loop iterations in one timer tick, with or without reads of addr.
+static uint32_t
+probe_loops(volatile uint8_t *p, bool access)
+{
+    uint32_t n = 0;
+    uint32_t t = timer_uptime();
+
+    while (timer_uptime() == t) {
+        cpu_idle();
+    }
+    t = timer_uptime();
+    if (access) {
+        while (timer_uptime() == t) {
+            for (uint32_t i = 0; i < PROBE_UNROLL; i++) {
+                (void)*p;
+            }
+            n++;
+        }
+    } else {
+        while (timer_uptime() == t) {
+            for (uint32_t i = 0; i < PROBE_UNROLL; i++) {
+                __asm__ volatile ("" : : : "memory");
+            }
+            n++;
+        }
+    }
+    return n;
+}
+
+// Nanoseconds per byte read, less the cost of an empty loop.
+static uint32_t
+probe_time(uint32_t addr, uint32_t idle_ns)
+{
+    const uint32_t n = probe_loops((volatile uint8_t *)addr, true);
+    const uint32_t loop_ns = (1000000000U / TIMER_HZ) / (n ? n : 1);
+
+    return (loop_ns > idle_ns) ? ((loop_ns - idle_ns) / PROBE_UNROLL) : 0;
+}
+
+static void
+probe_copy_name(char *dst, const char *src)
+{
+    for (uint32_t i = 0; i < sizeof(probe_regions[0].name); i++) {
+        dst[i] = src[i];
+    }
+}
+
+static task_t probe_task;
+static uint32_t probe_space;            // walk position
+static uint32_t probe_window;
+static probe_region_t *probe_region;    // region being extended
+static uint32_t probe_idle_ns;
+
+static void
+probe_reset(void)
+{
+    const uint32_t idle = probe_loops(NULL, false);
+
+    probe_idle_ns = (1000000000U / TIMER_HZ) / (idle ? idle : 1);
+    probe_count = 0;
+    probe_space = 0;
+    probe_window = probe_spaces[0].base;
+    probe_region = NULL;
+}
+
+// Probe the next window, timing it if it starts a region; returns
+// false once every space has been walked.
+static bool
+probe_step(void)
+{
+    if (probe_space == (sizeof(probe_spaces) / sizeof(probe_spaces[0]))) {
+        return false;
+    }
+    const uint32_t base = probe_window;
+    const uint32_t step = probe_spaces[probe_space].step;
+    const uint32_t addr = base + probe_spaces[probe_space].offset;
+
+    if (!probe_responds(addr)) {
+        probe_region = NULL;
+    } else if (probe_region != NULL) {
+        probe_region->limit = base + step;
+    } else if (probe_count < PROBE_REGIONS_MAX) {
+        probe_region = &probe_regions[probe_count++];
+        probe_region->base = base;
+        probe_region->limit = base + step;
+        probe_region->access_ns = probe_time(addr, probe_idle_ns);
+        probe_copy_name(probe_region->name, probe_spaces[probe_space].name);
+    }
+
+    // regions don't span spaces
+    probe_window += step;
+    if (probe_window >= probe_spaces[probe_space].limit) {
+        if (++probe_space < (sizeof(probe_spaces) / sizeof(probe_spaces[0]))) {
+            probe_window = probe_spaces[probe_space].base;
+        }
+        probe_region = NULL;
+    }
+    return true;
+}
+
+static void
+probe_print(void)
+{
+    PRINT("** Bus       : ", DEC(probe_count), " regions responding\n");
+    for (uint32_t i = 0; i < probe_count; i++) {
+        const probe_region_t *region = &probe_regions[i];
+        PRINT("**   ", HEX(region->base), "...", HEX(region->limit - 1), " ",
+              region->name, " ", DEC(region->access_ns), "ns\n");
+    }
+}
+
+// Walk a window per pass, so the probe overlaps with autoboot.
+static uint8_t
+probe_task_run(task_t *t)
+{
+    TASK_BEGIN(t);
+    probe_reset();
+    while (probe_step()) {
+        TASK_YIELD(t);
+    }
+    probe_print();
+    TASK_END(t);
+}
+
+// Build the bus map in the background and print it when complete;
+// takes a timer tick per responding region, plus one.
+void
+probe_start(void)
+{
+    task_add(&probe_task, probe_task_run);
+}
+
+bool
+probe_done(void)
+{
+    return !task_active(&probe_task);
+}
+
+// Returns the number of regions and points *map at them.
+uint32_t
+probe_map(const probe_region_t **map)
+{
+    *map = probe_regions;
+    return probe_count;
+}
@@ -0,0 +1,69 @@
+#!python3
+#
+# Symbolise an IP940 loader profile dump against the profiled ELF.
+#
+# Capture the console output from "++ profile ..." to "++ end profile"
+# into a file, then:
+#
+#   profile.py <program.elf> <dump.txt>
+#
+
+import subprocess
+import sys
+
+NM = "m68k-elf-nm"
+
+
+def load_symbols(elf):
+    symbols = []
+    output = subprocess.run([NM, "-n", "--defined-only", elf],
+                            capture_output=True, text=True, check=True).stdout
+    for line in output.splitlines():
+        fields = line.split()
+        if len(fields) == 3 and fields[1] in "tTwW":
+            symbols.append((int(fields[0], 16), fields[2]))
+    return symbols
+
+
+def load_dump(path):
+    samples = []
+    total = 0
+    with open(path) as f:
+        in_profile = False
+        for line in f:
+            line = line.strip()
+            if line.startswith("++ profile"):
+                in_profile = True
+                total = int(line.split("samples")[1].split()[0])
+            elif line.startswith("++ end profile"):
+                break
+            elif in_profile and line.startswith("0x"):
+                addr, count = line.split()
+                samples.append((int(addr, 16), int(count)))
+    return samples, total
+
+
+def symbolise(symbols, addr):
+    name = "?"
+    for sym_addr, sym_name in symbols:
+        if sym_addr > addr:
+            break
+        name = sym_name
+    return name
+
+
+if len(sys.argv) != 3:
+    print(f"usage: {sys.argv[0]} <program.elf> <dump.txt>")
+    sys.exit(1)
+
+symbols = load_symbols(sys.argv[1])
+samples, total = load_dump(sys.argv[2])
+
+functions = {}
+for addr, count in samples:
+    name = symbolise(symbols, addr)
+    functions[name] = functions.get(name, 0) + count
+
+total = max(total, 1)
+for name, count in sorted(functions.items(), key=lambda x: x[1], reverse=True):
+    print(f"{count:8d} {count / total * 100:6.2f}%  {name}")